@@ -1,3 +1,21 @@
+// Attendance is split into one sheet per shard, named after the base sheet
+// ("Attendance May" or "Attendance Term 1"), so header scans, statistics
+// and sorts only cover the shard a record falls in. Rolled-up totals live
+// on the "<base> Summary" sheet.
+const SHARD_BY = "month"; // "month" or "term"
+
+const MONTH_NAMES = [
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+];
+
+// Terms by calendar month, used when SHARD_BY is "term"
+const TERMS = [
+  { name: "Term 1", months: [9, 10, 11, 12] },
+  { name: "Term 2", months: [1, 2, 3, 4] },
+  { name: "Term 3", months: [5, 6, 7, 8] },
+];
+
 // This function is the main handler for HTTP requests from the ESP32
 function doPost(e) {
   try {
@@ -49,46 +67,28 @@ function handleBatchAttendance(data) {
 
     Logger.log("Processing batch attendance: " + records.length + " records");
 
-    // Open the spreadsheet and get the sheet
     const ss = SpreadsheetApp.getActiveSpreadsheet();
-    let sheet = ss.getSheetByName(sheetName);
-
-    // Create the sheet if it doesn't exist
-    if (!sheet) {
-      sheet = ss.insertSheet(sheetName);
-      initializeSheetHeaders(sheet);
-      Logger.log("Created new sheet: " + sheetName);
-    } else {
-      // Ensure the headers exist even if the sheet already exists
-      ensureHeaders(sheet);
-    }
 
-    // Process each record
+    // Route each record to its shard, then process shard by shard
+    const shards = groupRecordsByShard(sheetName, records);
     const results = [];
-    for (let i = 0; i < records.length; i++) {
-      const record = records[i];
-
-      // Process each individual record using the existing function logic
-      // but without returning after each one
-      const result = processAttendanceRecord(sheet, record);
-      results.push(result);
-
-      // Log progress for large batches
-      if (i > 0 && i % 10 === 0) {
-        Logger.log(`Processed ${i} of ${records.length} records`);
+    const touched = {};
+    shards.forEach((shardRecords, shardName) => {
+      const shard = processShard(ss, shardName, shardRecords);
+      results.push.apply(results, shard.results);
+      if (shard.stats) {
+        touched[shardName] = shard.stats;
       }
-    }
-
-    // Update statistics after all records have been processed
-    updateAttendanceStatistics(sheet);
+    });
 
-    // Sort the sheet by student ID
-    sortSheetByStudentId(sheet);
+    // Roll the touched shards up into the summary sheet
+    updateSummarySheet(ss, sheetName, touched);
 
     return ContentService.createTextOutput(
       JSON.stringify({
         result: "success",
         message: `Successfully processed ${records.length} attendance records`,
+        shards: Array.from(shards.keys()),
         details: results,
       })
     ).setMimeType(ContentService.MimeType.JSON);
@@ -100,6 +100,99 @@ function handleBatchAttendance(data) {
   }
 }
 
+// Use provided date from the ESP32 if available, otherwise use today's date
+function recordDate(data) {
+  if (data.date) {
+    // Use the date as-is without format checking
+    return data.date;
+  }
+  return Utilities.formatDate(
+    new Date(),
+    Session.getScriptTimeZone(),
+    "MM/dd/yyyy"
+  );
+}
+
+// Month (1-12) of a record date: "D/M" from the ESP32 or "MM/dd/yyyy" when
+// the date was filled in here. Returns null if it cannot be parsed.
+function recordMonth(date) {
+  const parts = date.toString().trim().split("/");
+  let month = NaN;
+  if (parts.length === 2) {
+    month = Number(parts[1]);
+  } else if (parts.length === 3) {
+    month = Number(parts[0]);
+  }
+  return month >= 1 && month <= 12 ? month : null;
+}
+
+// Name of the shard sheet a record date belongs to
+function shardSheetName(baseName, date) {
+  const month = recordMonth(date);
+  if (month === null) {
+    return baseName + " Other";
+  }
+  if (SHARD_BY === "term") {
+    for (let i = 0; i < TERMS.length; i++) {
+      if (TERMS[i].months.indexOf(month) !== -1) {
+        return baseName + " " + TERMS[i].name;
+      }
+    }
+  }
+  return baseName + " " + MONTH_NAMES[month - 1];
+}
+
+// Group records by shard sheet, keeping batch order within each shard
+function groupRecordsByShard(baseName, records) {
+  const shards = new Map();
+  for (let i = 0; i < records.length; i++) {
+    const name = shardSheetName(baseName, recordDate(records[i]));
+    if (!shards.has(name)) {
+      shards.set(name, []);
+    }
+    shards.get(name).push(records[i]);
+  }
+  return shards;
+}
+
+// Get a sheet by name, creating it with headers if it doesn't exist
+function openAttendanceSheet(ss, name) {
+  let sheet = ss.getSheetByName(name);
+  if (!sheet) {
+    sheet = ss.insertSheet(name);
+    initializeSheetHeaders(sheet);
+    Logger.log("Created new sheet: " + name);
+  } else {
+    // Ensure the headers exist even if the sheet already exists
+    ensureHeaders(sheet);
+  }
+  return sheet;
+}
+
+// Apply a shard's records, then refresh its statistics and sort it.
+// Returns the per-record results and the shard's statistics.
+function processShard(ss, shardName, records) {
+  const sheet = openAttendanceSheet(ss, shardName);
+
+  const results = [];
+  for (let i = 0; i < records.length; i++) {
+    results.push(processAttendanceRecord(sheet, records[i]));
+
+    // Log progress for large batches
+    if (i > 0 && i % 10 === 0) {
+      Logger.log(`${shardName}: processed ${i} of ${records.length} records`);
+    }
+  }
+
+  // Update statistics after all records have been processed
+  const stats = updateAttendanceStatistics(sheet);
+
+  // Sort the sheet by student ID
+  sortSheetByStudentId(sheet);
+
+  return { results, stats };
+}
+
 // Helper function to process an individual attendance record
 // Extracted from markColumnAttendance for reuse in batch processing
 function processAttendanceRecord(sheet, data) {
@@ -110,19 +203,7 @@ function processAttendanceRecord(sheet, data) {
     // Use status field directly - if available, otherwise default to "present"
     const attendanceValue = data.status || "present";
 
-    // Use provided date from the ESP32 if available, otherwise use today's date
-    let formattedDate;
-    if (data.date) {
-      // Use the date as-is without format checking
-      formattedDate = data.date;
-    } else {
-      // If no date provided, use today's date
-      formattedDate = Utilities.formatDate(
-        new Date(),
-        Session.getScriptTimeZone(),
-        "MM/dd/yyyy"
-      );
-    }
+    const formattedDate = recordDate(data);
 
     // Get all headers at once
     const lastColumn = Math.max(sheet.getLastColumn(), 1);
@@ -207,28 +288,18 @@ function processAttendanceRecord(sheet, data) {
 // Modified markColumnAttendance to use the shared processing function
 function markColumnAttendance(data) {
   try {
-    // Open the spreadsheet and get the sheet
     const ss = SpreadsheetApp.getActiveSpreadsheet();
-    let sheet = ss.getSheetByName(data.sheet_name);
-
-    // Create the sheet if it doesn't exist
-    if (!sheet) {
-      sheet = ss.insertSheet(data.sheet_name);
-      initializeSheetHeaders(sheet);
-    } else {
-      // Ensure the headers exist even if the sheet already exists
-      ensureHeaders(sheet);
-    }
-
-    // Process the attendance record
-    const result = processAttendanceRecord(sheet, data);
+    const shardName = shardSheetName(data.sheet_name, recordDate(data));
 
-    // Update statistics
-    ensureStatisticColumns(sheet);
-    updateAttendanceStatistics(sheet);
+    // Process the attendance record in its shard
+    const shard = processShard(ss, shardName, [data]);
+    const result = shard.results[0];
 
-    // Sort the sheet by student ID
-    sortSheetByStudentId(sheet);
+    const touched = {};
+    if (shard.stats) {
+      touched[shardName] = shard.stats;
+    }
+    updateSummarySheet(ss, data.sheet_name, touched);
 
     return ContentService.createTextOutput(
       JSON.stringify({
@@ -376,12 +447,13 @@ function ensureStatisticColumns(sheet) {
   return { attendedDaysCol, percentageCol };
 }
 
-// Function to update attendance statistics for all students
+// Function to update attendance statistics for all students. Returns the
+// number of sessions and each student's attended days, or null on error.
 function updateAttendanceStatistics(sheet) {
   try {
     // Skip if the sheet is empty or only has headers
     if (sheet.getLastRow() <= 1) {
-      return;
+      return { sessions: 0, present: {} };
     }
 
     // Get column positions
@@ -406,6 +478,8 @@ function updateAttendanceStatistics(sheet) {
 
     // For each student, calculate attendance statistics
     const studentCount = sheet.getLastRow() - 1; // Exclude header row
+    const studentIds = sheet.getRange(2, 1, studentCount, 1).getValues();
+    const present = {};
     for (let i = 0; i < studentCount; i++) {
       const studentRow = i + 2; // Row index is 1-based and skip header
 
@@ -425,6 +499,9 @@ function updateAttendanceStatistics(sheet) {
 
       // Update attendance statistics
       sheet.getRange(studentRow, attendedDaysCol).setValue(presentCount);
+      if (studentIds[i][0] !== "") {
+        present[studentIds[i][0].toString()] = presentCount;
+      }
 
       // Calculate percentage (avoid division by zero)
       if (totalDays > 0) {
@@ -445,7 +522,142 @@ function updateAttendanceStatistics(sheet) {
     Logger.log(
       "Updated attendance statistics for " + studentCount + " students"
     );
+
+    return { sessions: dateColumns.length, present };
   } catch (error) {
     Logger.log("Error updating statistics: " + error.toString());
+    return null;
+  }
+}
+
+// Roll shard statistics up into the summary sheet. Only the columns of the
+// shards in `touched` are replaced; totals for the other shards come from
+// the summary itself, so no other shard sheet is read. Layout:
+//   row 1: Student ID | Attended Days | Percentage | <shard> ...
+//   row 2: Sessions   | total         |            | sessions per shard
+//   row 3+: one row per student, attended days per shard
+function updateSummarySheet(ss, baseName, touched) {
+  const shardNames = Object.keys(touched);
+  if (shardNames.length === 0) {
+    return;
+  }
+
+  try {
+    const name = baseName + " Summary";
+    let sheet = ss.getSheetByName(name);
+    if (!sheet) {
+      sheet = ss.insertSheet(name);
+      sheet.getRange(1, 1, 2, 3).setValues([
+        ["Student ID", "Attended Days", "Percentage"],
+        ["Sessions", 0, ""],
+      ]);
+      sheet.getRange("1:1").setFontWeight("bold");
+      sheet.getRange("1:1").setBackground("#E0E0E0");
+      sheet.setFrozenRows(2);
+      Logger.log("Created summary sheet: " + name);
+    }
+
+    // Read the whole summary once and rebuild it in memory
+    const lastRow = Math.max(sheet.getLastRow(), 2);
+    const lastColumn = Math.max(sheet.getLastColumn(), 3);
+    const values = sheet.getRange(1, 1, lastRow, lastColumn).getValues();
+    const header = values[0];
+
+    const rowById = {};
+    for (let r = 2; r < values.length; r++) {
+      if (values[r][0] !== "") {
+        rowById[values[r][0].toString()] = values[r];
+      }
+    }
+
+    shardNames.forEach((shardName) => {
+      let column = header.indexOf(shardName);
+      if (column === -1) {
+        column = header.length;
+        header.push(shardName);
+      }
+
+      const stats = touched[shardName];
+      values[1][column] = stats.sessions;
+
+      // Replace the shard's column for every student
+      for (let r = 2; r < values.length; r++) {
+        values[r][column] = 0;
+      }
+      Object.keys(stats.present).forEach((id) => {
+        let row = rowById[id];
+        if (!row) {
+          row = [id, 0, ""];
+          rowById[id] = row;
+          values.push(row);
+        }
+        row[column] = stats.present[id];
+      });
+    });
+
+    // Fill gaps left by new rows and columns, then recompute the totals
+    const width = header.length;
+    for (let r = 1; r < values.length; r++) {
+      for (let c = 3; c < width; c++) {
+        if (values[r][c] === undefined || values[r][c] === "") {
+          values[r][c] = 0;
+        }
+      }
+    }
+
+    let totalSessions = 0;
+    for (let c = 3; c < width; c++) {
+      totalSessions += Number(values[1][c]) || 0;
+    }
+    values[1][1] = totalSessions;
+
+    for (let r = 2; r < values.length; r++) {
+      let attended = 0;
+      for (let c = 3; c < width; c++) {
+        attended += Number(values[r][c]) || 0;
+      }
+      values[r][1] = attended;
+      values[r][2] =
+        totalSessions > 0
+          ? ((attended / totalSessions) * 100).toFixed(1) + "%"
+          : "N/A";
+    }
+
+    // Keep student rows ordered by ID, as on the shard sheets
+    const students = values.slice(2).sort((a, b) => {
+      const x = Number(a[0]);
+      const y = Number(b[0]);
+      return x === y ? 0 : x < y ? -1 : 1;
+    });
+    const output = values.slice(0, 2).concat(students);
+
+    sheet.getRange(1, 1, output.length, width).setValues(output);
+    Logger.log(
+      "Updated summary for " + shardNames.join(", ") + " (" + students.length + " students)"
+    );
+  } catch (error) {
+    Logger.log("Error updating summary: " + error.toString());
   }
 }
+
+// Rebuild the summary from every shard sheet. Run from the editor after
+// editing a shard by hand or to seed the summary for existing shards.
+function rebuildAttendanceSummary(baseName) {
+  baseName = baseName || "Attendance";
+  const ss = SpreadsheetApp.getActiveSpreadsheet();
+  const prefix = baseName + " ";
+  const touched = {};
+
+  ss.getSheets().forEach((sheet) => {
+    const name = sheet.getName();
+    if (name.indexOf(prefix) !== 0 || name === baseName + " Summary") {
+      return;
+    }
+    const stats = updateAttendanceStatistics(sheet);
+    if (stats) {
+      touched[name] = stats;
+    }
+  });
+
+  updateSummarySheet(ss, baseName, touched);
+}
@@ -0,0 +1,283 @@
+#include "sync_journal.h"
+
+#include <string.h>
+
+bool parseLogLine(char *line, LogRecord *record)
+{
+  char *fields[4];
+  fields[0] = line;
+  for (int i = 1; i < 4; i++)
+  {
+    char *comma = strchr(fields[i - 1], ',');
+    if (comma == NULL)
+    {
+      return false;
+    }
+    *comma = '\0';
+    fields[i] = comma + 1;
+  }
+
+  record->date = fields[0];
+  record->studentId = fields[1];
+  record->status = fields[2];
+  record->synced = fields[3][0] == LOG_FLAG_SYNCED;
+  return true;
+}
+
+size_t readLogLine(SyncStorage &storage, char *buffer, size_t size)
+{
+  size_t length = 0;
+  uint8_t c;
+  while (length < size - 1 && storage.read(&c, 1) == 1 && c != '\n')
+  {
+    buffer[length++] = c;
+  }
+  buffer[length] = '\0';
+  while (length > 0 && buffer[length - 1] == '\r')
+  {
+    buffer[--length] = '\0';
+  }
+  return length;
+}
+
+// FNV-1a over every field but the checksum
+uint32_t syncJournalChecksum(const SyncJournalEntry &entry)
+{
+  const uint8_t *bytes = (const uint8_t *)&entry;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(SyncJournalEntry, checksum); i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+bool readSyncJournal(SyncJournal &journal, SyncJournalEntry *entry)
+{
+  SyncStorage &storage = *journal.storage;
+  if (!storage.exists(journal.journalPath) || !storage.open(journal.journalPath, "r"))
+  {
+    return false;
+  }
+
+  bool found = false;
+  for (int slot = 0; slot < SYNC_JOURNAL_SLOTS; slot++)
+  {
+    SyncJournalEntry candidate;
+    if (storage.read((uint8_t *)&candidate, sizeof(candidate)) != sizeof(candidate))
+    {
+      break;
+    }
+    if (candidate.magic != SYNC_JOURNAL_MAGIC || candidate.checksum != syncJournalChecksum(candidate))
+    {
+      continue;
+    }
+    if (!found || candidate.sequence > entry->sequence)
+    {
+      *entry = candidate;
+      found = true;
+    }
+  }
+  storage.close();
+  return found;
+}
+
+// Create the journal with empty slots, or recreate one whose creation was
+// cut short; until both slots exist no entry can have been written
+static bool prepareSyncJournal(SyncJournal &journal)
+{
+  SyncStorage &storage = *journal.storage;
+  const uint32_t fullSize = SYNC_JOURNAL_SLOTS * sizeof(SyncJournalEntry);
+  if (storage.exists(journal.journalPath) && storage.open(journal.journalPath, "r"))
+  {
+    uint32_t size = storage.size();
+    storage.close();
+    if (size >= fullSize)
+    {
+      return true;
+    }
+  }
+
+  if (!storage.open(journal.journalPath, "w"))
+  {
+    return false;
+  }
+  bool written = true;
+  SyncJournalEntry empty = {};
+  for (int slot = 0; slot < SYNC_JOURNAL_SLOTS; slot++)
+  {
+    written = written && storage.write((const uint8_t *)&empty, sizeof(empty)) == sizeof(empty);
+  }
+  storage.close();
+  return written;
+}
+
+bool writeSyncJournal(SyncJournal &journal, uint32_t state, uint32_t batchStart, uint32_t batchEnd,
+                      uint32_t logSize, uint32_t unsynced)
+{
+  SyncStorage &storage = *journal.storage;
+  if (!prepareSyncJournal(journal))
+  {
+    return false;
+  }
+
+  SyncJournalEntry entry;
+  entry.magic = SYNC_JOURNAL_MAGIC;
+  entry.sequence = ++journal.sequence;
+  entry.state = state;
+  entry.batchStart = batchStart;
+  entry.batchEnd = batchEnd;
+  entry.logSize = logSize;
+  entry.unsyncedCount = unsynced;
+  entry.checksum = syncJournalChecksum(entry);
+
+  if (!storage.open(journal.journalPath, "r+"))
+  {
+    return false;
+  }
+  bool written = storage.seek((entry.sequence % SYNC_JOURNAL_SLOTS) * sizeof(entry)) &&
+                 storage.write((const uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+  storage.close();
+  return written;
+}
+
+int applySyncFlags(SyncJournal &journal, uint32_t start, uint32_t end)
+{
+  SyncStorage &storage = *journal.storage;
+  if (!storage.open(journal.logPath, "r+"))
+  {
+    return -1;
+  }
+
+  int flipped = 0;
+  char line[LOG_LINE_MAX];
+  uint32_t lineStart = start;
+  while (lineStart < end && storage.seek(lineStart))
+  {
+    size_t length = readLogLine(storage, line, sizeof(line));
+    uint32_t next = storage.position();
+    if (next <= lineStart)
+    {
+      break; // End of file
+    }
+    // The flag is the last character of "date,student_id,status,synced"
+    if (length > 2 && line[length - 2] == ',' && line[length - 1] == LOG_FLAG_UNSYNCED &&
+        storage.seek(lineStart + length - 1))
+    {
+      const uint8_t synced = LOG_FLAG_SYNCED;
+      if (storage.write(&synced, 1) == 1)
+      {
+        flipped++;
+      }
+    }
+    lineStart = next;
+  }
+  storage.close();
+  return flipped;
+}
+
+int commitSyncBatch(SyncJournal &journal, uint32_t batchStart, uint32_t batchEnd, uint32_t logSize,
+                    int unsyncedAfter)
+{
+  if (!writeSyncJournal(journal, SYNC_BATCH_COMMITTED, batchStart, batchEnd, logSize, unsyncedAfter))
+  {
+    return SYNC_COMMIT_NO_JOURNAL;
+  }
+  int flipped = applySyncFlags(journal, batchStart, batchEnd);
+  if (flipped < 0)
+  {
+    return SYNC_COMMIT_NO_LOG;
+  }
+  writeSyncJournal(journal, SYNC_BATCH_DONE, batchStart, batchEnd, logSize, unsyncedAfter);
+  return flipped;
+}
+
+int countUnsyncedRecords(SyncJournal &journal, uint32_t offset)
+{
+  SyncStorage &storage = *journal.storage;
+  if (!storage.open(journal.logPath, "r"))
+  {
+    return 0;
+  }
+
+  int count = 0;
+  char line[LOG_LINE_MAX];
+  if (offset == 0)
+  {
+    readLogLine(storage, line, sizeof(line)); // Skip header
+  }
+  else
+  {
+    storage.seek(offset);
+  }
+  while (storage.position() < storage.size())
+  {
+    LogRecord record;
+    if (readLogLine(storage, line, sizeof(line)) > 1 && parseLogLine(line, &record) && !record.synced)
+    {
+      count++;
+    }
+  }
+  storage.close();
+  return count;
+}
+
+uint32_t syncLogSize(SyncJournal &journal)
+{
+  SyncStorage &storage = *journal.storage;
+  if (!storage.open(journal.logPath, "r"))
+  {
+    return 0;
+  }
+  uint32_t size = storage.size();
+  storage.close();
+  return size;
+}
+
+SyncRecovery recoverSyncJournal(SyncJournal &journal)
+{
+  SyncRecovery recovery = {};
+  recovery.finishedRecords = -1;
+  recovery.logSize = syncLogSize(journal);
+
+  SyncJournalEntry entry;
+  bool haveJournal = readSyncJournal(journal, &entry);
+  if (haveJournal)
+  {
+    journal.sequence = entry.sequence;
+    recovery.journalLogSize = entry.logSize;
+  }
+
+  if (!haveJournal || entry.logSize > recovery.logSize || entry.batchEnd > entry.logSize)
+  {
+    // First boot with a journal, or the log was replaced behind its back
+    recovery.rescanned = true;
+    recovery.journalMismatch = haveJournal;
+    recovery.unsyncedCount = countUnsyncedRecords(journal, 0);
+    writeSyncJournal(journal, SYNC_BATCH_DONE, 0, 0, recovery.logSize, recovery.unsyncedCount);
+    return recovery;
+  }
+
+  if (entry.state == SYNC_BATCH_COMMITTED)
+  {
+    recovery.finishedRecords = applySyncFlags(journal, entry.batchStart, entry.batchEnd);
+    if (recovery.finishedRecords < 0)
+    {
+      // The checkpoint assumes the batch is applied, so it cannot be used.
+      // Keep the intent for the next boot and count what the flags say.
+      recovery.batchPending = true;
+      recovery.unsyncedCount = countUnsyncedRecords(journal, 0);
+      return recovery;
+    }
+  }
+
+  recovery.unsyncedCount = entry.unsyncedCount + countUnsyncedRecords(journal, entry.logSize);
+
+  // Checkpoint at the end of the log, which also marks a finished batch
+  // done, so the next boot skips everything counted here
+  if (entry.state == SYNC_BATCH_COMMITTED || recovery.logSize != entry.logSize)
+  {
+    writeSyncJournal(journal, SYNC_BATCH_DONE, 0, 0, recovery.logSize, recovery.unsyncedCount);
+  }
+  return recovery;
+}
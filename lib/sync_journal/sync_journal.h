@@ -0,0 +1,137 @@
+#ifndef SYNC_JOURNAL_H
+#define SYNC_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Attendance log records and the sync commit journal
+//
+// A sync batch is committed by flipping the synced flags of its records in
+// place, never by rewriting the log. Before the first flip the batch is
+// recorded in the journal as committed; after the last flip it is marked
+// done. A power cut in between is finished at boot by flipping the rest of
+// the batch's byte range, which is safe to repeat.
+//
+// Every journal entry also checkpoints the log size and unsynced count, so
+// boot reads only the journal, the interrupted batch (if any) and the log
+// tail appended since the checkpoint, however long the log has grown.
+// Recovery moves the checkpoint to the end of the log, and the firmware
+// adds one every few appends, so the tail stays short even on a device
+// that has been offline for days.
+//
+// The journal holds two slots written alternately. Each carries a sequence
+// number and a checksum; the newest valid slot wins, so a slot torn by a
+// power cut leaves the previous one in charge.
+//
+// Files are reached through SyncStorage so the same code runs against
+// SPIFFS on the board and against an in-memory store in the native tests.
+// ---------------------------------------------------------------------------
+
+#define LOG_LINE_MAX 64
+
+// One parsed line of the attendance log. Fields point into the line buffer.
+struct LogRecord
+{
+  const char *date;
+  const char *studentId;
+  const char *status;
+  bool synced;
+};
+
+// Values of the synced flag
+#define LOG_FLAG_UNSYNCED '0'
+#define LOG_FLAG_SYNCED '1'
+
+// Split a "date,student_id,status,synced" line in place
+bool parseLogLine(char *line, LogRecord *record);
+
+// The files the journal works on, one open at a time
+class SyncStorage
+{
+public:
+  virtual ~SyncStorage() {}
+  virtual bool exists(const char *path) = 0;
+  // Make path the open file. Modes are the SPIFFS ones: "r", "w", "r+".
+  virtual bool open(const char *path, const char *mode) = 0;
+  virtual void close() = 0;
+  virtual bool seek(uint32_t offset) = 0;
+  virtual uint32_t position() = 0;
+  virtual uint32_t size() = 0;
+  virtual size_t read(uint8_t *buffer, size_t length) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t length) = 0;
+};
+
+// Read one line from the open file into buffer, without the line ending.
+// Returns the line length.
+size_t readLogLine(SyncStorage &storage, char *buffer, size_t size);
+
+struct SyncJournal
+{
+  SyncStorage *storage;
+  const char *journalPath;
+  const char *logPath;
+  uint32_t sequence; // Of the newest entry written or recovered
+};
+
+#define SYNC_JOURNAL_MAGIC 0x4C4E4A53 // "SJNL"
+#define SYNC_JOURNAL_SLOTS 2
+#define SYNC_BATCH_DONE 0
+#define SYNC_BATCH_COMMITTED 1
+
+// commitSyncBatch failures
+#define SYNC_COMMIT_NO_JOURNAL -1 // Nothing changed
+#define SYNC_COMMIT_NO_LOG -2     // Left committed; recovery sets the flags
+
+struct SyncJournalEntry
+{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t state;
+  uint32_t batchStart;    // Log offset of the first record in the batch
+  uint32_t batchEnd;      // Log offset just past the last record
+  uint32_t logSize;       // Log size covered by unsyncedCount
+  uint32_t unsyncedCount; // Unsynced records once the batch is applied
+  uint32_t checksum;
+};
+
+// What boot recovery found, for the caller to report
+struct SyncRecovery
+{
+  int unsyncedCount;
+  bool rescanned;         // No usable journal, so the whole log was counted
+  bool journalMismatch;   // A journal was found but did not fit the log
+  int finishedRecords;    // Flags set for an interrupted batch, -1 if none
+  bool batchPending;      // An interrupted batch is left for the next boot
+  uint32_t logSize;
+  uint32_t journalLogSize; // Log size of the checkpoint recovered from
+};
+
+uint32_t syncJournalChecksum(const SyncJournalEntry &entry);
+
+// Newest valid entry, or false if neither slot holds one
+bool readSyncJournal(SyncJournal &journal, SyncJournalEntry *entry);
+
+// Write the next entry into the slot not holding the current one
+bool writeSyncJournal(SyncJournal &journal, uint32_t state, uint32_t batchStart, uint32_t batchEnd,
+                      uint32_t logSize, uint32_t unsynced);
+
+// Set every unsynced flag in [start, end) to synced. Returns the number
+// flipped, or -1 if the log cannot be opened.
+int applySyncFlags(SyncJournal &journal, uint32_t start, uint32_t end);
+
+// Mark a batch synced: journal the intent, flip the flags, mark it done.
+// Returns the number flipped or one of the SYNC_COMMIT_* failures.
+int commitSyncBatch(SyncJournal &journal, uint32_t batchStart, uint32_t batchEnd, uint32_t logSize,
+                    int unsyncedAfter);
+
+// Count records not yet uploaded from offset to the end of the log
+int countUnsyncedRecords(SyncJournal &journal, uint32_t offset);
+
+uint32_t syncLogSize(SyncJournal &journal);
+
+// Finish an interrupted commit, restore the unsynced count from the
+// journal checkpoint plus the log tail, and checkpoint the result
+SyncRecovery recoverSyncJournal(SyncJournal &journal);
+
+#endif
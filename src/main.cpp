@@ -5,6 +5,9 @@
 #include <SPI.h>
 #include <FS.h>
 #include <SPIFFS.h>
+#include <Preferences.h>
+#include <esp_heap_caps.h>
+#include <sync_journal.h>
 
 // WiFi credentials
 const char *ssid = "Sony Xperia 1 III";
@@ -18,6 +21,14 @@ const char *host = "script.google.com";
 const int httpsPort = 443;
 String url = String("/macros/s/") + GScriptId + "/exec";
 
+// MQTT streaming uplink (empty disables it). Point it at a host running
+// tools/mqtt-standin.js --forward, which writes each record to the sheet
+// before acknowledging it.
+const char *mqttBroker = "";
+const uint16_t mqttPort = 1883;
+const char *mqttTopic = "attendance/records";
+const char *mqttClientId = "esp32-attendance";
+
 // On ESP32, use Serial2 for hardware serial
 #define FINGERPRINT_SERIAL Serial2
 
@@ -28,15 +39,27 @@ Adafruit_Fingerprint finger = Adafruit_Fingerprint(&FINGERPRINT_SERIAL);
 int u = 0;
 int v = 0;
 int count = 0;
-String currentDate = "19/5"; // Default date (today's date)
+char currentDate[12] = "19/5"; // Default date (today's date)
+int unsyncedCount = 0;             // Records in the log not yet uploaded
+unsigned long lastSyncRttMs = 0;   // Round trip of the last sync request
+bool lastSyncRequestSent = false;  // Whether the last sync got as far as a request
 
 // CSV file path in SPIFFS
 const char *attendanceFilePath = "/attendance.csv";
+const char *attendanceLogHeader = "date,student_id,status,synced";
+
+// Sync commit journal in SPIFFS
+const char *syncJournalPath = "/sync.journal";
+
+// Fingerprint template archive in SPIFFS
+const char *templateArchivePath = "/templates.bin";
 
 // Function prototypes
 void initSPIFFS();
-void syncToGoogle();
-void saveAttendanceToFile(String studentId);
+int syncToGoogle(int maxRecords = 0);
+unsigned long syncRequestTimeout();
+unsigned long syncBackoffDelay();
+long saveAttendanceToFile(const char *studentId);
 void showMainMenu();
 void setupLEDs();
 void indicateSuccess();
@@ -44,18 +67,315 @@ void indicateFailure();
 void clearAttendanceData();
 void connectToWiFi();
 void disconnectWiFi();
+void templateTransferMode();
+bool serviceSyncScheduler(bool inAttendanceMode, bool idleGap);
+void serviceStreamingUplink();
+bool streamUplinkConnected();
+bool streamUplinkActive();
+bool streamRecordInFlight(long flagOffset);
+void showStreamStats();
+uint16_t findOccupiedSlots(uint16_t *ids, uint16_t maxIds);
+int serviceFingerprintScan();
+void cancelFingerprintScan();
+bool fingerprintScanIdle();
+void consolePrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void logPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// ---------------------------------------------------------------------------
+// Console output and logging
+//
+// Output is formatted into a stack buffer and queued on a TX ring that a
+// low-priority task drains into the UART, so callers never wait on the
+// serial port. Interactive output waits for ring space when it is full;
+// log lines are dropped and counted instead, so the scan path never blocks.
+//
+// LOG_ERROR .. LOG_DEBUG above LOG_LEVEL (set from build_flags in
+// platformio.ini) compile to nothing and their arguments are never
+// evaluated. Format strings are wrapped in PSTR so they stay in flash.
+// ---------------------------------------------------------------------------
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Disabled levels keep their arguments type-checked but generate no code
+#define LOG_DISABLED(format, ...)       \
+  do                                    \
+  {                                     \
+    if (0)                              \
+      logPrintf(format, ##__VA_ARGS__); \
+  } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) logPrintf(PSTR("[E] " format "\n"), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) logPrintf(PSTR("[W] " format "\n"), ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) logPrintf(PSTR(format "\n"), ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) logPrintf(PSTR("[D] " format "\n"), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+
+#define CONSOLE_LINE_MAX 192
+#define CONSOLE_TX_RING_SIZE 2048 // Must be a power of two
+
+uint8_t consoleTxRing[CONSOLE_TX_RING_SIZE];
+volatile uint32_t consoleTxHead = 0; // Advanced by the loop task
+volatile uint32_t consoleTxTail = 0; // Advanced by the TX task
+TaskHandle_t consoleTxTask = NULL;
+uint32_t consoleDroppedLines = 0;
+
+size_t consoleTxSpace()
+{
+  return CONSOLE_TX_RING_SIZE - (consoleTxHead - __atomic_load_n(&consoleTxTail, __ATOMIC_ACQUIRE));
+}
+
+// Queue bytes for the TX task. With wait = false the whole write is
+// dropped if it does not fit.
+bool consoleEnqueue(const uint8_t *data, size_t length, bool wait)
+{
+  if (consoleTxTask == NULL)
+  {
+    Serial.write(data, length); // TX task not started yet
+    return true;
+  }
+  if (!wait && consoleTxSpace() < length)
+  {
+    consoleDroppedLines++;
+    return false;
+  }
+
+  while (length > 0)
+  {
+    size_t space = consoleTxSpace();
+    if (space == 0)
+    {
+      xTaskNotifyGive(consoleTxTask);
+      vTaskDelay(1);
+      continue;
+    }
+
+    uint32_t head = consoleTxHead;
+    size_t offset = head & (CONSOLE_TX_RING_SIZE - 1);
+    size_t n = min(min(length, space), CONSOLE_TX_RING_SIZE - offset);
+    memcpy(consoleTxRing + offset, data, n);
+    __atomic_store_n(&consoleTxHead, head + n, __ATOMIC_RELEASE);
+    data += n;
+    length -= n;
+  }
+  xTaskNotifyGive(consoleTxTask);
+  return true;
+}
+
+void consoleTxLoop(void *)
+{
+  while (true)
+  {
+    uint32_t head = __atomic_load_n(&consoleTxHead, __ATOMIC_ACQUIRE);
+    uint32_t tail = consoleTxTail;
+    if (head == tail)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    size_t offset = tail & (CONSOLE_TX_RING_SIZE - 1);
+    size_t n = min((size_t)(head - tail), CONSOLE_TX_RING_SIZE - offset);
+    Serial.write(consoleTxRing + offset, n);
+    __atomic_store_n(&consoleTxTail, tail + n, __ATOMIC_RELEASE);
+  }
+}
+
+void startConsoleTx()
+{
+  xTaskCreatePinnedToCore(consoleTxLoop, "consoleTx", 2048, NULL, 1, &consoleTxTask, 0);
+}
+
+// Block until everything queued has been handed to the UART
+void consoleFlush()
+{
+  while (consoleTxTask != NULL && __atomic_load_n(&consoleTxTail, __ATOMIC_ACQUIRE) != consoleTxHead)
+  {
+    vTaskDelay(1);
+  }
+}
+
+void consoleWrite(const uint8_t *data, size_t length)
+{
+  consoleEnqueue(data, length, true);
+}
+
+void consolePuts(const char *text)
+{
+  consoleEnqueue((const uint8_t *)text, strlen(text), true);
+  consoleEnqueue((const uint8_t *)"\r\n", 2, true);
+}
+
+void consoleVPrintf(bool wait, const char *format, va_list args)
+{
+  char line[CONSOLE_LINE_MAX];
+  int length = vsnprintf(line, sizeof(line), format, args);
+  if (length > 0)
+  {
+    consoleEnqueue((const uint8_t *)line, min((size_t)length, sizeof(line) - 1), wait);
+  }
+}
+
+// Interactive output: waits for ring space rather than dropping
+void consolePrintf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  consoleVPrintf(true, format, args);
+  va_end(args);
+}
+
+// Log output behind the LOG_* macros: never blocks the caller
+void logPrintf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  consoleVPrintf(false, format, args);
+  va_end(args);
+}
+
+// ---------------------------------------------------------------------------
+// Heap-free scratch memory
+//
+// String concatenation allocates on every call and fragments the heap over
+// long uptimes. Input and log lines are read into fixed buffers, and
+// per-operation scratch space (sync payloads, HTTP responses) comes from a
+// static arena that is reset when the operation ends.
+// ---------------------------------------------------------------------------
+
+#define INPUT_LINE_MAX 2112 // Fits a serial template import line
+#define SESSION_ARENA_SIZE 16384
+#define SYNC_RESPONSE_MAX 512
+
+uint8_t sessionArena[SESSION_ARENA_SIZE];
+size_t sessionArenaUsed = 0;
+size_t sessionArenaPeak = 0;
+uint32_t minLargestFreeBlock = UINT32_MAX; // Sampled after each sync and scan
+
+// Bump allocation from the session arena. Returns NULL when it is full.
+void *arenaAlloc(size_t size)
+{
+  size_t start = (sessionArenaUsed + 3) & ~(size_t)3;
+  if (start + size > SESSION_ARENA_SIZE)
+  {
+    return NULL;
+  }
+  sessionArenaUsed = start + size;
+  sessionArenaPeak = max(sessionArenaPeak, sessionArenaUsed);
+  return sessionArena + start;
+}
+
+size_t arenaAvailable()
+{
+  size_t start = (sessionArenaUsed + 3) & ~(size_t)3;
+  return start < SESSION_ARENA_SIZE ? SESSION_ARENA_SIZE - start : 0;
+}
+
+// Releases everything allocated from the arena when it goes out of scope
+struct ArenaScope
+{
+  size_t mark;
+  ArenaScope() : mark(sessionArenaUsed) {}
+  ~ArenaScope() { sessionArenaUsed = mark; }
+};
+
+void sampleHeapWatermark()
+{
+  uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  minLargestFreeBlock = min(minLargestFreeBlock, largest);
+}
+
+void showHeapStatus()
+{
+  sampleHeapWatermark();
+  consolePrintf("\n--- Heap Status ---\n");
+  consolePrintf("Uptime: %lu min\n", millis() / 60000);
+  consolePrintf("Free heap: %u bytes\n", (unsigned)ESP.getFreeHeap());
+  consolePrintf("Largest free block: %u bytes (lowest sampled %u)\n",
+                (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), (unsigned)minLargestFreeBlock);
+  consolePrintf("Minimum free heap since boot: %u bytes\n", (unsigned)ESP.getMinFreeHeap());
+  consolePrintf("Session arena peak: %u of %u bytes\n", (unsigned)sessionArenaPeak, SESSION_ARENA_SIZE);
+  consolePrintf("Log lines dropped (console ring full): %lu\n", (unsigned long)consoleDroppedLines);
+  consolePrintf("-------------------\n\n");
+}
+
+// Strip leading and trailing whitespace (including '\r') in place
+char *trimLine(char *line)
+{
+  while (*line == ' ' || *line == '\t' || *line == '\r')
+  {
+    line++;
+  }
+  size_t length = strlen(line);
+  while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r'))
+  {
+    line[--length] = '\0';
+  }
+  return line;
+}
 
-// Helper function to read input from Serial only
-String readInput()
+// SPIFFS behind the journal's storage interface
+class SpiffsSyncStorage : public SyncStorage
 {
-  String input = "";
+public:
+  bool exists(const char *path) { return SPIFFS.exists(path); }
+  bool open(const char *path, const char *mode)
+  {
+    file = SPIFFS.open(path, mode);
+    return (bool)file;
+  }
+  void close() { file.close(); }
+  bool seek(uint32_t offset) { return file.seek(offset); }
+  uint32_t position() { return file.position(); }
+  uint32_t size() { return file.size(); }
+  size_t read(uint8_t *buffer, size_t length) { return file.read(buffer, length); }
+  size_t write(const uint8_t *buffer, size_t length) { return file.write(buffer, length); }
+
+private:
+  File file;
+};
+
+// The attendance log and sync journal are read through this, one file open
+// at a time, with readLogLine from lib/sync_journal
+SpiffsSyncStorage spiffsSyncStorage;
+
+// Helper function to read input from Serial only. Returns a static buffer
+// that is overwritten by the next call.
+const char *readInput()
+{
+  static char input[INPUT_LINE_MAX];
   while (true)
   {
     if (Serial.available())
     {
-      input = Serial.readStringUntil('\n');
-      input.trim();
-      return input;
+      size_t length = Serial.readBytesUntil('\n', input, sizeof(input) - 1);
+      input[length] = '\0';
+      return trimLine(input);
     }
     delay(10); // Short delay to prevent CPU hogging
   }
@@ -67,689 +387,2935 @@ uint8_t readnumber()
   uint8_t num = 0;
   while (num == 0)
   {
-    String input = readInput();
-    if (input.length() > 0)
+    const char *input = readInput();
+    if (input[0] != '\0')
     {
-      num = input.toInt();
+      num = atoi(input);
     }
   }
   return num;
 }
 
-void initSPIFFS()
+// ---------------------------------------------------------------------------
+// Menu dispatch
+//
+// Menus are tables of label and handler. The option number is the entry's
+// position in the table, so adding a command is a single table line.
+// ---------------------------------------------------------------------------
+
+struct MenuCommand
 {
-  if (!SPIFFS.begin(true))
+  const char *label;
+  void (*handler)();
+};
+
+#define MENU_SIZE(table) (sizeof(table) / sizeof((table)[0]))
+
+void printMenu(const char *title, const MenuCommand *commands, size_t count)
+{
+  consolePrintf("\n%s\n", title);
+  for (size_t i = 0; i < count; i++)
   {
-    Serial.println("SPIFFS Mount Failed");
-    return;
+    consolePrintf("%u. %s\n", (unsigned)(i + 1), commands[i].label);
   }
+}
 
-  // Check if attendance file exists, if not create it with headers
-  if (!SPIFFS.exists(attendanceFilePath))
+// Parse a menu option; returns 0 if it is not a number in 1..limit
+size_t parseMenuChoice(const char *option, size_t limit)
+{
+  char *end;
+  unsigned long choice = strtoul(option, &end, 10);
+  if (end == option || *end != '\0' || choice < 1 || choice > limit)
   {
-    File file = SPIFFS.open(attendanceFilePath, FILE_WRITE);
-    if (!file)
-    {
-      Serial.println("Failed to create file");
-      return;
-    }
-    // Write CSV headers
-    file.println("date,student_id,status,synced");
-    file.close();
-    Serial.println("Created attendance file with headers");
+    return 0;
   }
-  else
+  return choice;
+}
+
+// Run the selected command; returns false if the option is not in the table
+bool dispatchMenu(const MenuCommand *commands, size_t count, const char *option)
+{
+  size_t choice = parseMenuChoice(option, count);
+  if (choice == 0)
   {
-    Serial.println("Attendance file exists");
+    return false;
   }
+  commands[choice - 1].handler();
+  return true;
 }
 
-void saveAttendanceToFile(String studentId)
+// Submenu loop; the option after the last command returns to the caller
+void runSubmenu(const char *title, const MenuCommand *commands, size_t count)
 {
-  File file = SPIFFS.open(attendanceFilePath, FILE_APPEND);
-  if (!file)
+  while (true)
   {
-    Serial.println("Failed to open file for appending");
-    return;
+    printMenu(title, commands, count);
+    consolePrintf("%u. Return to main menu\n", (unsigned)(count + 1));
+
+    const char *option = readInput();
+    if (parseMenuChoice(option, count + 1) == count + 1)
+    {
+      break;
+    }
+    if (!dispatchMenu(commands, count, option))
+    {
+      consolePrintf("Invalid choice. Please enter 1-%u.\n", (unsigned)(count + 1));
+    }
   }
+}
 
-  // Format: date,student_id,status,synced
-  String record = currentDate + "," + studentId + ",present,0";
-  file.println(record);
-  file.close();
+// ---------------------------------------------------------------------------
+// On-device attendance analytics
+//
+// Per-student present-day counters and the set of distinct session dates
+// (dates with at least one record) are kept in RAM. They are built from the
+// log the first time the analytics menu is opened, so boot time does not
+// grow with the log; after that addAttendance updates them in O(1). A
+// per-student bitmap over session dates makes repeat scans on the same day
+// count once.
+// ---------------------------------------------------------------------------
+
+#define ANALYTICS_MAX_STUDENTS 128 // Student IDs are fingerprint slots 1-127
+#define ANALYTICS_MAX_DATES 366
+#define ANALYTICS_DATE_LEN sizeof(currentDate) // Any date attendance mode accepts fits
+#define ANALYTICS_HASH_SLOTS 512
+#define ATTENDANCE_THRESHOLD 75.0f
+
+char sessionDates[ANALYTICS_MAX_DATES][ANALYTICS_DATE_LEN];
+uint16_t sessionDateCount = 0;
+uint16_t sessionDateSlots[ANALYTICS_HASH_SLOTS]; // Date index + 1, 0 = empty
+uint16_t presentDays[ANALYTICS_MAX_STUDENTS];
+uint8_t presentBits[ANALYTICS_MAX_STUDENTS][(ANALYTICS_MAX_DATES + 7) / 8];
+bool analyticsLoaded = false;
+uint32_t analyticsSkipped = 0; // Records left out: date too long or table full
+
+void resetAnalytics()
+{
+  sessionDateCount = 0;
+  memset(sessionDateSlots, 0, sizeof(sessionDateSlots));
+  memset(presentDays, 0, sizeof(presentDays));
+  memset(presentBits, 0, sizeof(presentBits));
+  analyticsSkipped = 0;
+}
 
-  Serial.println("Saved attendance record to file: " + record);
+// FNV-1a over the date string
+uint32_t hashDate(const char *date)
+{
+  uint32_t hash = 2166136261u;
+  while (*date)
+  {
+    hash = (hash ^ (uint8_t)*date++) * 16777619u;
+  }
+  return hash;
 }
 
-void connectToWiFi()
+// Index of a session date, added if new. Returns -1 if the date is too long
+// or the table is full.
+int sessionDateIndex(const char *date)
 {
-  if (WiFi.status() == WL_CONNECTED)
+  if (strlen(date) >= ANALYTICS_DATE_LEN)
   {
-    Serial.println("WiFi already connected!");
-    return;
+    return -1;
   }
 
-  Serial.println("Connecting to " + String(ssid) + " ...");
-  WiFi.begin(ssid, password);
+  uint32_t slot = hashDate(date) % ANALYTICS_HASH_SLOTS;
+  while (sessionDateSlots[slot] != 0)
+  {
+    uint16_t index = sessionDateSlots[slot] - 1;
+    if (strcmp(sessionDates[index], date) == 0)
+    {
+      return index;
+    }
+    slot = (slot + 1) % ANALYTICS_HASH_SLOTS;
+  }
 
-  int wifiCounter = 0;
-  while (WiFi.status() != WL_CONNECTED && wifiCounter < 20) // Timeout after 20 seconds
+  if (sessionDateCount >= ANALYTICS_MAX_DATES)
   {
-    delay(1000);
-    Serial.println(".");
-    wifiCounter++;
+    return -1;
   }
+  strcpy(sessionDates[sessionDateCount], date);
+  sessionDateSlots[slot] = ++sessionDateCount;
+  return sessionDateCount - 1;
+}
 
-  if (WiFi.status() == WL_CONNECTED)
+void recordAnalytics(const char *date, int studentId)
+{
+  if (studentId <= 0 || studentId >= ANALYTICS_MAX_STUDENTS)
   {
-    Serial.println("\nConnection established!");
-    Serial.println("IP address: " + WiFi.localIP().toString());
+    return;
   }
-  else
+  int index = sessionDateIndex(date);
+  if (index < 0)
+  {
+    analyticsSkipped++;
+    return;
+  }
+
+  uint8_t mask = 1 << (index % 8);
+  uint8_t &bits = presentBits[studentId][index / 8];
+  if (!(bits & mask))
   {
-    Serial.println("\nWiFi connection failed! Cannot sync to Google Sheets.");
+    bits |= mask;
+    presentDays[studentId]++;
   }
 }
 
-void disconnectWiFi()
+float attendancePercent(int studentId)
 {
-  if (WiFi.status() == WL_CONNECTED)
+  if (sessionDateCount == 0)
   {
-    Serial.println("Disconnecting from WiFi...");
-    WiFi.disconnect();
-    Serial.println("WiFi disconnected");
+    return 0.0f;
   }
+  return 100.0f * presentDays[studentId] / sessionDateCount;
 }
 
-void syncToGoogle()
+void showStudentAttendance(int studentId)
 {
-  // Connect to WiFi before syncing
-  connectToWiFi();
-
-  if (WiFi.status() != WL_CONNECTED)
+  if (studentId <= 0 || studentId >= ANALYTICS_MAX_STUDENTS)
   {
-    Serial.println("WiFi not connected. Cannot sync to Google Sheets.");
+    consolePrintf("Student ID must be between 1 and %d\n", ANALYTICS_MAX_STUDENTS - 1);
     return;
   }
+  consolePrintf("Student %d: %u of %u days (%.1f%%)\n", studentId, presentDays[studentId],
+                sessionDateCount, attendancePercent(studentId));
+}
 
-  File file = SPIFFS.open(attendanceFilePath, FILE_READ);
-  if (!file)
+// List students below the threshold. Enrolled students with no records at
+// all are included, so the sensor's slot list is merged in.
+void showStudentsBelow(float threshold)
+{
+  static uint16_t enrolled[ANALYTICS_MAX_STUDENTS];
+  bool listed[ANALYTICS_MAX_STUDENTS] = {false};
+  uint16_t enrolledCount = findOccupiedSlots(enrolled, ANALYTICS_MAX_STUDENTS);
+  for (uint16_t i = 0; i < enrolledCount; i++)
   {
-    Serial.println("Failed to open file for reading");
-    disconnectWiFi();
-    return;
+    listed[enrolled[i]] = true;
   }
 
-  // Read the header line and discard
-  String header = file.readStringUntil('\n');
+  consolePrintf("\n--- Below %.0f%% (%u session dates) ---\n", threshold, sessionDateCount);
+  int below = 0;
+  for (int id = 1; id < ANALYTICS_MAX_STUDENTS; id++)
+  {
+    if (!listed[id] && presentDays[id] == 0)
+    {
+      continue;
+    }
+    if (attendancePercent(id) < threshold)
+    {
+      showStudentAttendance(id);
+      below++;
+    }
+  }
+  consolePrintf("--- %d students below threshold ---\n", below);
+  if (analyticsSkipped > 0)
+  {
+    consolePrintf("Note: %lu records not counted (date too long or over %d dates)\n",
+                  (unsigned long)analyticsSkipped, ANALYTICS_MAX_DATES);
+  }
+  consolePuts("");
+}
 
-  // Temporary file to store synced records
-  File tempFile = SPIFFS.open("/temp.csv", FILE_WRITE);
-  if (!tempFile)
+// Build the counters from the whole log
+void loadAnalytics()
+{
+  resetAnalytics();
+  analyticsLoaded = true;
+  SyncStorage &logFile = spiffsSyncStorage;
+  if (!logFile.open(attendanceFilePath, FILE_READ))
   {
-    Serial.println("Failed to create temp file");
-    file.close();
-    disconnectWiFi();
     return;
   }
 
-  // Write the header to temp file
-  tempFile.println(header);
+  unsigned long start = millis();
+  char line[LOG_LINE_MAX];
+  readLogLine(logFile, line, sizeof(line)); // Skip header
+  while (logFile.position() < logFile.size())
+  {
+    LogRecord record;
+    if (readLogLine(logFile, line, sizeof(line)) <= 1 || !parseLogLine(line, &record))
+      continue;
 
-  WiFiClientSecure client;
-  client.setInsecure(); // Ignore SSL certificate validation
+    if (strcmp(record.status, "present") == 0)
+    {
+      recordAnalytics(record.date, atoi(record.studentId));
+    }
+  }
+  logFile.close();
 
-  // Increase timeout values for client
-  client.setTimeout(20000); // 20 seconds timeout
+  LOG_INFO("Analytics loaded: %u session dates (log scanned in %lu ms)", sessionDateCount, millis() - start);
+  if (analyticsSkipped > 0)
+  {
+    LOG_WARN("%lu records left out of analytics", (unsigned long)analyticsSkipped);
+  }
+}
 
-  HTTPClient http;
-  // Increase timeout values for HTTP client
-  http.setTimeout(20000);
+void promptStudentAttendance()
+{
+  consolePuts("Enter student ID:");
+  showStudentAttendance(readnumber());
+}
 
-  String fullUrl = "https://" + String(host) + url;
+void showStudentsBelowDefault()
+{
+  showStudentsBelow(ATTENDANCE_THRESHOLD);
+}
 
-  // Build JSON array of records to sync
-  String jsonPayload = "{\"command\": \"batch_attendance\", \"sheet_name\": \"Attendance\", \"records\": [";
+void promptStudentsBelowThreshold()
+{
+  consolePuts("Enter threshold percentage:");
+  showStudentsBelow(atof(readInput()));
+}
 
-  int recordCount = 0;
-  bool hasUnsyncedRecords = false;
+// Filled in from ATTENDANCE_THRESHOLD when the menu is opened
+char studentsBelowDefaultLabel[32];
 
-  // First pass: count unsynchronized records and build JSON array
-  while (file.available())
-  {
-    String line = file.readStringUntil('\n');
-    if (line.length() <= 1)
-      continue; // Skip empty lines
+const MenuCommand analyticsMenu[] = {
+    {"Attendance % for a student", promptStudentAttendance},
+    {studentsBelowDefaultLabel, showStudentsBelowDefault},
+    {"Students below a custom threshold", promptStudentsBelowThreshold},
+};
 
-    // Parse the CSV line
-    int commaPos1 = line.indexOf(',');
-    int commaPos2 = line.indexOf(',', commaPos1 + 1);
-    int commaPos3 = line.indexOf(',', commaPos2 + 1);
+void analyticsMode()
+{
+  if (!analyticsLoaded)
+  {
+    loadAnalytics();
+  }
+  snprintf(studentsBelowDefaultLabel, sizeof(studentsBelowDefaultLabel), "Students below %.0f%%",
+           ATTENDANCE_THRESHOLD);
+  runSubmenu("Attendance analytics:", analyticsMenu, MENU_SIZE(analyticsMenu));
+}
 
-    String date = line.substring(0, commaPos1);
-    String studentId = line.substring(commaPos1 + 1, commaPos2);
-    String status = line.substring(commaPos2 + 1, commaPos3);
-    String synced = line.substring(commaPos3 + 1);
+// ---------------------------------------------------------------------------
+// Sync commit journal
+//
+// The journal itself lives in lib/sync_journal so it can be tested on the
+// host; this section runs it on spiffsSyncStorage and reports what it did.
+// ---------------------------------------------------------------------------
 
-    // Only include records that haven't been synced yet
-    if (synced.toInt() == 0)
-    {
-      // Add comma if not the first record
-      if (hasUnsyncedRecords)
-      {
-        jsonPayload += ",";
-      }
+#define SYNC_CHECKPOINT_APPENDS 50 // Bounds the log tail boot has to count
 
-      // Add this record to the JSON array
+SyncJournal syncJournal = {&spiffsSyncStorage, syncJournalPath, attendanceFilePath, 0};
+int appendsSinceCheckpoint = 0;
 
-      jsonPayload += "{\"date\":\"" + date + "\",\"student_id\":\"" + studentId + "\",\"status\":\"" + status + "\"}";
+// Record a checkpoint with no batch in flight
+bool checkpointSyncJournal(uint32_t logSize)
+{
+  appendsSinceCheckpoint = 0;
+  return writeSyncJournal(syncJournal, SYNC_BATCH_DONE, 0, 0, logSize, unsyncedCount);
+}
 
-      hasUnsyncedRecords = true;
-      recordCount++;
-    }
+// Commit an uploaded batch and update the unsynced count. Returns the number
+// of records marked, or -1.
+int markBatchSynced(uint32_t batchStart, uint32_t batchEnd, uint32_t logSize, int unsyncedAfter)
+{
+  int flipped = commitSyncBatch(syncJournal, batchStart, batchEnd, logSize, unsyncedAfter);
+  if (flipped == SYNC_COMMIT_NO_JOURNAL)
+  {
+    LOG_ERROR("Failed to write sync journal");
+    return -1;
   }
+  if (flipped == SYNC_COMMIT_NO_LOG)
+  {
+    // Left committed; the flags are set at the next boot
+    LOG_ERROR("Failed to open log to mark synced records");
+    return -1;
+  }
+  unsyncedCount = unsyncedAfter;
+  return flipped;
+}
 
-  // Close the JSON array and object
-  jsonPayload += "]}";
-
-  // Reset file position to beginning (after header)
-  file.seek(0);
-  file.readStringUntil('\n'); // Skip header
+// Restore the unsynced count at boot, finishing any interrupted commit
+void restoreSyncState()
+{
+  unsigned long start = millis();
+  SyncRecovery recovery = recoverSyncJournal(syncJournal);
+  unsyncedCount = recovery.unsyncedCount;
 
-  // If no records to sync, just report and exit
-  if (!hasUnsyncedRecords)
+  if (recovery.rescanned)
   {
-    Serial.println("No unsynced records found. Nothing to upload.");
-    file.close();
-    tempFile.close();
-    disconnectWiFi();
+    if (recovery.journalMismatch)
+    {
+      LOG_WARN("Sync journal expects %lu log bytes, found %lu; rescanned", (unsigned long)recovery.journalLogSize,
+               (unsigned long)recovery.logSize);
+    }
+    LOG_INFO("Unsynced records: %d (full log scan in %lu ms)", unsyncedCount, millis() - start);
     return;
   }
 
-  Serial.println("Publishing " + String(recordCount) + " attendance records to Google Sheets...");
-  Serial.println("Payload size: " + String(jsonPayload.length()) + " bytes");
-
-  // Send the batch request
-  http.begin(client, fullUrl);
-  http.addHeader("Content-Type", "application/json");
-  int httpResponseCode = http.POST(jsonPayload);
-
-  bool syncSuccessful = false;
-
-  // Handle response
-  if (httpResponseCode > 0)
+  if (recovery.batchPending)
   {
-    String response = http.getString();
-    Serial.println("HTTP Response code: " + String(httpResponseCode));
-    Serial.println("Response: " + response);
-    syncSuccessful = true;
+    LOG_ERROR("Could not finish interrupted sync commit; unsynced records: %d (full log scan in %lu ms)",
+              unsyncedCount, millis() - start);
+    return;
   }
-  // Check for specific negative error codes that might still indicate success
-  else if (httpResponseCode == -11)
+  if (recovery.finishedRecords >= 0)
   {
-    Serial.println("Response timeout but data likely sent. HTTP Response code: " + String(httpResponseCode));
-    // Optimistically assume data was sent
-    syncSuccessful = true;
+    LOG_WARN("Finished interrupted sync commit: %d records marked", recovery.finishedRecords);
   }
-  else
+  LOG_INFO("Unsynced records: %d (recovered in %lu ms, %lu tail bytes)", unsyncedCount, millis() - start,
+           (unsigned long)(recovery.logSize - recovery.journalLogSize));
+}
+
+void initSPIFFS()
+{
+  if (!SPIFFS.begin(true))
   {
-    Serial.println("Error publishing data. HTTP Response code: " + String(httpResponseCode));
-    syncSuccessful = false;
+    LOG_ERROR("SPIFFS Mount Failed");
+    return;
   }
 
-  http.end();
-
-  // Now update the local records based on sync result
-  while (file.available())
+  // Older firmware rewrote the log through /temp.csv; a power cut between
+  // removing the log and renaming the copy left only the copy
+  if (SPIFFS.exists("/temp.csv"))
   {
-    String line = file.readStringUntil('\n');
-    if (line.length() <= 1)
-    {
-      continue; // Skip empty lines
-    }
-
-    // Parse the CSV line to check sync status
-    int lastCommaPos = line.lastIndexOf(',');
-    String syncStatus = line.substring(lastCommaPos + 1);
-
-    if (syncStatus.toInt() == 0 && syncSuccessful)
+    if (!SPIFFS.exists(attendanceFilePath))
     {
-      // Mark as synced by replacing the last 0 with 1
-      String updatedLine = line.substring(0, lastCommaPos + 1) + "1";
-      tempFile.println(updatedLine);
+      LOG_WARN("Restoring attendance log from interrupted rewrite");
+      SPIFFS.rename("/temp.csv", attendanceFilePath);
     }
     else
     {
-      // Keep line as is
-      tempFile.println(line);
+      SPIFFS.remove("/temp.csv");
     }
   }
 
-  file.close();
-  tempFile.close();
-
-  // Replace the original file with the temp file
-  SPIFFS.remove(attendanceFilePath);
-  SPIFFS.rename("/temp.csv", attendanceFilePath);
-
-  if (syncSuccessful)
+  // Check if attendance file exists, if not create it with headers
+  if (!SPIFFS.exists(attendanceFilePath))
   {
-    Serial.println("Sync completed successfully. " + String(recordCount) + " records synced.");
+    File file = SPIFFS.open(attendanceFilePath, FILE_WRITE);
+    if (!file)
+    {
+      LOG_ERROR("Failed to create file");
+      return;
+    }
+    // Write CSV headers
+    file.println(attendanceLogHeader);
+    file.close();
+    LOG_INFO("Created attendance file with headers");
   }
   else
   {
-    Serial.println("Sync failed. Will try again later.");
+    LOG_INFO("Attendance file exists");
   }
 
-  // Disconnect from WiFi after syncing
-  disconnectWiFi();
+  restoreSyncState();
 }
 
-uint8_t getFingerprintEnroll(uint8_t id)
+// Append a record and return the file offset of its synced flag, or -1 on
+// failure. The offset lets an uplink mark the record synced in place.
+long saveAttendanceToFile(const char *studentId)
 {
-  int p = -1;
-  Serial.println("Waiting for valid finger to enroll as #" + String(id));
-  while (p != FINGERPRINT_OK)
+  File file = SPIFFS.open(attendanceFilePath, FILE_APPEND);
+  if (!file)
   {
-    p = finger.getImage();
-    switch (p)
+    LOG_ERROR("Failed to open file for appending");
+    return -1;
+  }
+
+  // Format: date,student_id,status,synced
+  char record[LOG_LINE_MAX];
+  int length = snprintf(record, sizeof(record), "%s,%s,present,%c", currentDate, studentId, LOG_FLAG_UNSYNCED);
+  long flagOffset = file.size() + length - 1;
+  file.println(record);
+  uint32_t logSize = file.size();
+  file.close();
+  unsyncedCount++;
+
+  // Offline devices never commit a batch, so checkpoint as the log grows
+  if (++appendsSinceCheckpoint >= SYNC_CHECKPOINT_APPENDS)
+  {
+    checkpointSyncJournal(logSize);
+  }
+
+  LOG_DEBUG("Saved attendance record to file: %s", record);
+  return flagOffset;
+}
+
+// Flip a single record's synced flag without rewriting the log
+bool markRecordSynced(long flagOffset)
+{
+  File file = SPIFFS.open(attendanceFilePath, "r+");
+  if (!file)
+  {
+    return false;
+  }
+
+  // Only flip if the byte is still an unsynced flag; the log may have been
+  // cleared since the record was written
+  bool marked = false;
+  if (file.seek(flagOffset) && file.read() == LOG_FLAG_UNSYNCED && file.seek(flagOffset))
+  {
+    marked = file.write(LOG_FLAG_SYNCED) == 1;
+  }
+  file.close();
+  return marked;
+}
+
+void connectToWiFi()
+{
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    LOG_DEBUG("WiFi already connected!");
+    return;
+  }
+
+  LOG_INFO("Connecting to %s ...", ssid);
+  WiFi.begin(ssid, password);
+
+  int wifiCounter = 0;
+  while (WiFi.status() != WL_CONNECTED && wifiCounter < 20) // Timeout after 20 seconds
+  {
+    delay(1000);
+    LOG_DEBUG(".");
+    wifiCounter++;
+  }
+
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    LOG_INFO("Connection established!");
+    IPAddress ip = WiFi.localIP();
+    LOG_INFO("IP address: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  }
+  else
+  {
+    LOG_WARN("WiFi connection failed! Cannot sync to Google Sheets.");
+  }
+}
+
+void disconnectWiFi()
+{
+  // Keep the link up while the streaming session is using it
+  if (streamUplinkActive())
+  {
+    return;
+  }
+
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    LOG_DEBUG("Disconnecting from WiFi...");
+    WiFi.disconnect();
+    LOG_INFO("WiFi disconnected");
+  }
+}
+
+// Copy up to size - 1 bytes of the response body into buffer without
+// going through a String
+size_t readHttpResponse(HTTPClient &http, char *buffer, size_t size)
+{
+  WiFiClient *stream = http.getStreamPtr();
+  int contentLength = http.getSize();
+  size_t length = 0;
+
+  if (stream != NULL && contentLength > 0)
+  {
+    length = stream->readBytes(buffer, min((size_t)contentLength, size - 1));
+  }
+  else if (stream != NULL)
+  {
+    while (stream->available() && length < size - 1)
     {
-    case FINGERPRINT_OK:
-      Serial.println("Image taken");
-      break;
-    case FINGERPRINT_NOFINGER:
-      Serial.println(".");
-      break;
-    case FINGERPRINT_PACKETRECIEVEERR:
-      Serial.println("Communication error");
-      break;
-    case FINGERPRINT_IMAGEFAIL:
-      Serial.println("Imaging error");
+      buffer[length++] = stream->read();
+    }
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+// Sync up to maxRecords unsynced records (0 = as many as fit) in one batch.
+// A batch is also capped by the payload arena, roughly 300 records, so a
+// long backlog takes several calls. Returns the number of records marked as
+// synced, or -1 if the upload failed or could not be attempted.
+int syncToGoogle(int maxRecords)
+{
+  // Payload and response buffers come from the arena and are released on return
+  ArenaScope scratch;
+  lastSyncRequestSent = false;
+
+  // Connect to WiFi before syncing
+  connectToWiFi();
+
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    LOG_WARN("WiFi not connected. Cannot sync to Google Sheets.");
+    return -1;
+  }
+
+  SyncStorage &logFile = spiffsSyncStorage;
+  if (!logFile.open(attendanceFilePath, FILE_READ))
+  {
+    LOG_ERROR("Failed to open file for reading");
+    disconnectWiFi();
+    return -1;
+  }
+
+  // Read the header line and discard
+  char line[LOG_LINE_MAX];
+  readLogLine(logFile, line, sizeof(line));
+
+  // Scale timeouts with the measured round trip instead of a fixed 20 s
+  unsigned long timeoutMs = syncRequestTimeout();
+
+  WiFiClientSecure client;
+  client.setInsecure(); // Ignore SSL certificate validation
+  client.setTimeout(timeoutMs);
+
+  HTTPClient http;
+  http.setTimeout(timeoutMs);
+
+  char fullUrl[160];
+  snprintf(fullUrl, sizeof(fullUrl), "https://%s%s", host, url.c_str());
+
+  // Build JSON array of records to sync directly in the arena. A batch stops
+  // growing when the arena is full; the rest goes in the next batch.
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  char *response = (char *)arenaAlloc(SYNC_RESPONSE_MAX);
+#endif
+  size_t payloadCapacity = arenaAvailable();
+  char *jsonPayload = (char *)arenaAlloc(payloadCapacity);
+  size_t payloadLength = snprintf(jsonPayload, payloadCapacity,
+                                  "{\"command\": \"batch_attendance\", \"sheet_name\": \"Attendance\", \"records\": [");
+
+  int recordCount = 0;
+  bool hasUnsyncedRecords = false;
+  bool reachedEnd = false;
+
+  // Byte range of the batch in the log; every unsynced record inside it
+  // goes into the batch
+  uint32_t batchStart = 0;
+  uint32_t batchEnd = 0;
+
+  // Collect up to maxRecords unsynchronized records into the JSON array
+  while (true)
+  {
+    if (logFile.position() >= logFile.size())
+    {
+      reachedEnd = true;
       break;
-    default:
-      Serial.println("Unknown error");
+    }
+    if (maxRecords > 0 && recordCount >= maxRecords)
+    {
       break;
     }
 
-    if (p == FINGERPRINT_OK)
+    uint32_t lineStart = logFile.position();
+    size_t lineLength = readLogLine(logFile, line, sizeof(line));
+    if (lineLength <= 1)
+      continue; // Skip empty lines
+
+    // A record still waiting for its PUBACK may reach the sheet through the
+    // bridge; end the batch before it rather than upload it twice
+    if (streamRecordInFlight(lineStart + lineLength - 1))
     {
-      Serial.println("Stored!");
-      indicateSuccess(); // Success indicator
+      break;
     }
-    else
+
+    // Parse the CSV line
+    LogRecord record;
+    if (!parseLogLine(line, &record))
+      continue;
+
+    // Only include records that haven't been synced yet
+    if (!record.synced)
     {
-      // In failure cases
-      indicateFailure(); // Failure indicator
+      // Add comma if not the first record, and keep room for the closing "]}"
+      size_t room = payloadCapacity - payloadLength - 3;
+      int length = snprintf(jsonPayload + payloadLength, room,
+                            "%s{\"date\":\"%s\",\"student_id\":\"%s\",\"status\":\"%s\"}",
+                            hasUnsyncedRecords ? "," : "", record.date, record.studentId, record.status);
+      if (length < 0 || (size_t)length >= room)
+      {
+        break;
+      }
+      payloadLength += length;
+
+      if (!hasUnsyncedRecords)
+      {
+        batchStart = lineStart;
+      }
+      batchEnd = logFile.position();
+      hasUnsyncedRecords = true;
+      recordCount++;
     }
   }
+  uint32_t logSize = logFile.size();
+  logFile.close();
 
-  p = finger.image2Tz(1);
-  switch (p)
+  // Close the JSON array and object
+  jsonPayload[payloadLength++] = ']';
+  jsonPayload[payloadLength++] = '}';
+  jsonPayload[payloadLength] = '\0';
+
+  // If no records to sync, just report and exit
+  if (!hasUnsyncedRecords)
   {
-  case FINGERPRINT_OK:
-    Serial.println("Image converted");
-    break;
-  case FINGERPRINT_IMAGEMESS:
-    Serial.println("Image too messy");
-    return p;
-  case FINGERPRINT_PACKETRECIEVEERR:
-    Serial.println("Communication error");
-    return p;
-  case FINGERPRINT_FEATUREFAIL:
-    Serial.println("Could not find fingerprint features");
-    return p;
-  case FINGERPRINT_INVALIDIMAGE:
-    Serial.println("Could not find fingerprint features");
-    return p;
-  default:
-    Serial.println("Unknown error");
-    return p;
+    LOG_INFO("No unsynced records found. Nothing to upload.");
+    unsyncedCount = 0;
+    disconnectWiFi();
+    return 0;
   }
 
-  Serial.println("Remove finger");
-  delay(2000);
-  p = 0;
-  while (p != FINGERPRINT_NOFINGER)
+  LOG_INFO("Publishing %d attendance records to Google Sheets...", recordCount);
+  LOG_DEBUG("Payload size: %u bytes", (unsigned)payloadLength);
+
+  // Send the batch request
+  unsigned long requestStart = millis();
+  http.begin(client, fullUrl);
+  http.addHeader("Content-Type", "application/json");
+  int httpResponseCode = http.POST((uint8_t *)jsonPayload, payloadLength);
+  lastSyncRequestSent = true;
+
+  bool syncSuccessful = false;
+
+  // Handle response
+  if (httpResponseCode > 0)
   {
-    p = finger.getImage();
+    LOG_INFO("HTTP Response code: %d", httpResponseCode);
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    size_t responseLength = readHttpResponse(http, response, SYNC_RESPONSE_MAX);
+    LOG_DEBUG("Response: %.*s", (int)responseLength, response);
+#endif
+    syncSuccessful = true;
+  }
+  // Check for specific negative error codes that might still indicate success
+  else if (httpResponseCode == -11)
+  {
+    LOG_WARN("Response timeout but data likely sent. HTTP Response code: %d", httpResponseCode);
+    // Optimistically assume data was sent
+    syncSuccessful = true;
+  }
+  else
+  {
+    LOG_ERROR("Error publishing data. HTTP Response code: %d", httpResponseCode);
+    syncSuccessful = false;
   }
 
-  Serial.println("Place same finger again");
-  p = -1;
-  while (p != FINGERPRINT_OK)
+  http.end();
+  lastSyncRttMs = millis() - requestStart;
+
+  // Mark the batch synced in place through the journal, so a power cut
+  // cannot lose or half-apply it
+  int markedCount = 0;
+  if (syncSuccessful)
   {
-    p = finger.getImage();
-    switch (p)
+    int unsyncedAfter = reachedEnd ? 0 : max(unsyncedCount - recordCount, 0);
+    markedCount = markBatchSynced(batchStart, batchEnd, logSize, unsyncedAfter);
+    if (markedCount < 0)
     {
-    case FINGERPRINT_OK:
-      Serial.println("Image taken");
-      break;
-    case FINGERPRINT_NOFINGER:
-      Serial.println(".");
-      break;
-    case FINGERPRINT_PACKETRECIEVEERR:
-      Serial.println("Communication error");
-      break;
-    case FINGERPRINT_IMAGEFAIL:
-      Serial.println("Imaging error");
-      break;
-    default:
-      Serial.println("Unknown error");
-      break;
+      syncSuccessful = false;
     }
   }
 
-  p = finger.image2Tz(2);
-  switch (p)
+  if (syncSuccessful)
   {
-  case FINGERPRINT_OK:
-    Serial.println("Image converted");
-    break;
-  case FINGERPRINT_IMAGEMESS:
-    Serial.println("Image too messy");
-    return p;
-  case FINGERPRINT_PACKETRECIEVEERR:
-    Serial.println("Communication error");
-    return p;
-  case FINGERPRINT_FEATUREFAIL:
-    Serial.println("Could not find fingerprint features");
-    return p;
-  case FINGERPRINT_INVALIDIMAGE:
-    Serial.println("Could not find fingerprint features");
-    return p;
-  default:
-    Serial.println("Unknown error");
-    return p;
+    LOG_INFO("Sync completed successfully. %d records synced.", markedCount);
   }
-
-  p = finger.createModel();
-  if (p == FINGERPRINT_OK)
+  else
   {
-    Serial.println("Prints matched!");
+    LOG_WARN("Sync failed. Will try again later.");
   }
-  else if (p == FINGERPRINT_PACKETRECIEVEERR)
+
+  // Disconnect from WiFi after syncing
+  disconnectWiFi();
+  sampleHeapWatermark();
+
+  return syncSuccessful ? markedCount : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Background sync scheduler
+//
+// Syncs automatically when the backlog passes a threshold, when attendance
+// mode has been idle for a while, or on a timer. Batch size follows the
+// measured round trip and success rate; failures back off exponentially.
+// State is kept in NVS so backoff and link estimates survive a reboot.
+// ---------------------------------------------------------------------------
+
+#define SYNC_BACKLOG_THRESHOLD 20         // Records waiting before an immediate sync
+#define SYNC_INTERVAL_MS (15 * 60 * 1000) // Timer trigger while anything is unsynced
+#define SYNC_IDLE_GAP_MS (30 * 1000)      // Quiet time in attendance mode before syncing
+#define SYNC_TARGET_RTT_MS 8000           // Per-request time budget used to size batches
+#define SYNC_MIN_BATCH 5
+#define SYNC_MAX_BATCH 200
+#define SYNC_BACKOFF_BASE_MS (30 * 1000)
+#define SYNC_BACKOFF_MAX_MS (60 * 60 * 1000)
+#define SYNC_RATE_HEALTHY 0.99f // The smoothed rate only approaches 1; snap to it above this
+
+Preferences syncPrefs;
+
+struct SyncSchedulerState
+{
+  uint16_t batchSize;
+  uint8_t failureStreak;
+  float rttMs;       // Smoothed request round trip
+  float successRate; // Smoothed fraction of successful batches
+};
+
+SyncSchedulerState syncState = {20, 0, 0.0f, 1.0f};
+unsigned long nextSyncAttemptAt = 0;
+unsigned long lastSyncAt = 0;
+
+void loadSyncState()
+{
+  syncPrefs.begin("sync", true);
+  syncState.batchSize = syncPrefs.getUShort("batch", syncState.batchSize);
+  syncState.failureStreak = syncPrefs.getUChar("fails", 0);
+  syncState.rttMs = syncPrefs.getFloat("rtt", 0.0f);
+  syncState.successRate = syncPrefs.getFloat("success", 1.0f);
+  syncPrefs.end();
+
+  syncState.batchSize = constrain(syncState.batchSize, SYNC_MIN_BATCH, SYNC_MAX_BATCH);
+  syncState.successRate = constrain(syncState.successRate, 0.0f, 1.0f);
+  if (syncState.successRate > SYNC_RATE_HEALTHY)
   {
-    Serial.println("Communication error");
-    return p;
+    syncState.successRate = 1.0f;
   }
-  else if (p == FINGERPRINT_ENROLLMISMATCH)
+  nextSyncAttemptAt = millis() + syncBackoffDelay();
+}
+
+void saveSyncState()
+{
+  syncPrefs.begin("sync", false);
+  syncPrefs.putUShort("batch", syncState.batchSize);
+  syncPrefs.putUChar("fails", syncState.failureStreak);
+  syncPrefs.putFloat("rtt", syncState.rttMs);
+  syncPrefs.putFloat("success", syncState.successRate);
+  syncPrefs.end();
+}
+
+unsigned long syncBackoffDelay()
+{
+  if (syncState.failureStreak == 0)
   {
-    Serial.println("Fingerprints did not match");
-    return p;
+    return 0;
   }
-  else
+  uint8_t shift = min((int)syncState.failureStreak - 1, 10);
+  return min((unsigned long)SYNC_BACKOFF_BASE_MS << shift, (unsigned long)SYNC_BACKOFF_MAX_MS);
+}
+
+unsigned long syncRequestTimeout()
+{
+  if (syncState.rttMs <= 0)
   {
-    Serial.println("Unknown error");
-    return p;
+    return 20000; // No measurement yet
   }
+  return constrain((unsigned long)(syncState.rttMs * 3), 5000UL, 20000UL);
+}
+
+// Records at risk on a flaky link are limited by scaling the batch with the
+// observed success rate.
+int nextSyncBatchSize()
+{
+  int size = syncState.batchSize * max(syncState.successRate, 0.25f);
+  return constrain(size, SYNC_MIN_BATCH, SYNC_MAX_BATCH);
+}
+
+void recordSyncOutcome(bool success, unsigned long rttMs, int batchSize)
+{
+  // A batch counts as full if it was as large as the scheduler would send,
+  // judged before this outcome changes the success rate
+  bool fullBatch = batchSize >= nextSyncBatchSize();
+
+  syncState.successRate = 0.8f * syncState.successRate + (success ? 0.2f : 0.0f);
+  if (syncState.successRate > SYNC_RATE_HEALTHY)
+  {
+    syncState.successRate = 1.0f;
+  }
+
+  if (success)
+  {
+    syncState.rttMs = syncState.rttMs <= 0 ? rttMs : 0.7f * syncState.rttMs + 0.3f * rttMs;
+    syncState.failureStreak = 0;
+
+    // Grow while comfortably inside the time budget, shrink when over it
+    if (fullBatch && rttMs < SYNC_TARGET_RTT_MS / 2)
+    {
+      syncState.batchSize = min(syncState.batchSize * 2, SYNC_MAX_BATCH);
+    }
+    else if (rttMs > SYNC_TARGET_RTT_MS)
+    {
+      syncState.batchSize = max((int)(syncState.batchSize * SYNC_TARGET_RTT_MS / rttMs), SYNC_MIN_BATCH);
+    }
+  }
+  else
+  {
+    syncState.batchSize = max(syncState.batchSize / 2, SYNC_MIN_BATCH);
+    if (syncState.failureStreak < 255)
+    {
+      syncState.failureStreak++;
+    }
+  }
+
+  nextSyncAttemptAt = millis() + syncBackoffDelay();
+  saveSyncState();
+}
+
+// Called from the main loop and from the attendance scan loop. idleGap is
+// true once the scanner has been quiet for SYNC_IDLE_GAP_MS. Returns true if
+// a sync was attempted.
+bool serviceSyncScheduler(bool inAttendanceMode, bool idleGap)
+{
+  if (unsyncedCount == 0 || (long)(millis() - nextSyncAttemptAt) < 0)
+  {
+    return false;
+  }
+
+  // Never interrupt an active scanning session
+  if (inAttendanceMode && !idleGap)
+  {
+    return false;
+  }
+
+  const char *reason = NULL;
+  if (unsyncedCount >= SYNC_BACKLOG_THRESHOLD)
+  {
+    reason = "backlog threshold";
+  }
+  else if (idleGap)
+  {
+    reason = "scan idle gap";
+  }
+  else if (millis() - lastSyncAt >= SYNC_INTERVAL_MS)
+  {
+    reason = "sync timer";
+  }
+  if (reason == NULL)
+  {
+    return false;
+  }
+
+  int batchSize = nextSyncBatchSize();
+  LOG_INFO("Background sync (%s): %d unsynced, batch of %d", reason, unsyncedCount, batchSize);
+
+  lastSyncAt = millis();
+  int synced = syncToGoogle(batchSize);
+  if (synced < 0 || lastSyncRequestSent)
+  {
+    recordSyncOutcome(synced >= 0, lastSyncRttMs, batchSize);
+  }
+
+  if (synced < 0)
+  {
+    LOG_INFO("Next sync attempt in %lu s", syncBackoffDelay() / 1000);
+  }
+  return true;
+}
+
+void showSyncStatus()
+{
+  consolePuts("\n--- Sync Status ---");
+  consolePrintf("Unsynced records: %d\n", unsyncedCount);
+  consolePrintf("Batch size: %d (base %u)\n", nextSyncBatchSize(), syncState.batchSize);
+  consolePrintf("Smoothed RTT: %.0f ms\n", syncState.rttMs);
+  consolePrintf("Success rate: %.0f%%\n", syncState.successRate * 100);
+  consolePrintf("Failure streak: %u\n", syncState.failureStreak);
+  long wait = (long)(nextSyncAttemptAt - millis());
+  consolePrintf("Next attempt allowed in: %ld s\n", wait > 0 ? wait / 1000 : 0);
+  showStreamStats();
+  consolePuts("-------------------\n");
+}
+
+// ---------------------------------------------------------------------------
+// Streaming uplink over a persistent MQTT session
+//
+// While attendance mode is running, each record is published to the broker
+// as soon as it is saved (MQTT 3.1.1, QoS 1). The broker end is a bridge
+// (tools/mqtt-standin.js --forward) that posts the record to the Apps
+// Script and only sends the PUBACK once the sheet has it, so the PUBACK
+// marks the record synced. Anything not acknowledged stays unsynced and is
+// picked up by the HTTPS batch path, so an unreachable broker costs nothing
+// but latency.
+//
+// Connecting never blocks the scan loop for long: WiFi is joined in the
+// background, the TCP connect is only tried between scans with a short
+// timeout, and the CONNACK is collected by the service loop.
+// ---------------------------------------------------------------------------
+
+#define MQTT_KEEPALIVE_S 60
+#define STREAM_MAX_INFLIGHT 8
+#define STREAM_ACK_TIMEOUT_MS 10000 // Covers the bridge's round trip to the sheet
+#define STREAM_MAX_RETRIES 2
+#define STREAM_RECONNECT_MS 30000
+#define STREAM_WIFI_WAIT_MS 20000    // Background WiFi join before giving up
+#define STREAM_CONNECT_TIMEOUT_MS 250 // TCP connect to a LAN broker
+#define STREAM_CONNACK_TIMEOUT_MS 2000
+#define STREAM_PAYLOAD_MAX 96
+
+struct InflightRecord
+{
+  bool used;
+  uint16_t packetId;
+  long flagOffset;
+  unsigned long sentAtUs;
+  unsigned long lastSendMs;
+  uint8_t retries;
+  char payload[STREAM_PAYLOAD_MAX];
+};
+
+struct StreamStats
+{
+  uint32_t published;
+  uint32_t acked;
+  uint32_t expired;
+  uint32_t minAckUs;
+  uint32_t maxAckUs;
+  uint64_t totalAckUs;
+};
+
+enum StreamLinkState
+{
+  STREAM_OFFLINE,
+  STREAM_WAIT_WIFI,
+  STREAM_WAIT_CONNACK,
+  STREAM_ONLINE
+};
+
+WiFiClient mqttClient;
+StreamLinkState streamState = STREAM_OFFLINE;
+bool streamStarted = false;
+unsigned long streamDeadline = 0;
+InflightRecord inflight[STREAM_MAX_INFLIGHT];
+StreamStats streamStats = {0, 0, 0, UINT32_MAX, 0, 0};
+uint16_t nextPacketId = 1;
+unsigned long lastMqttSendMs = 0;
+unsigned long nextStreamConnectAt = 0;
+uint8_t mqttRxBuffer[32];
+uint8_t mqttRxLength = 0;
+
+bool streamUplinkConfigured()
+{
+  return mqttBroker != NULL && mqttBroker[0] != '\0';
+}
+
+// MQTT remaining-length varint. Returns bytes written.
+uint8_t encodeMqttLength(uint8_t *out, uint32_t length)
+{
+  uint8_t n = 0;
+  do
+  {
+    uint8_t digit = length % 128;
+    length /= 128;
+    if (length > 0)
+    {
+      digit |= 0x80;
+    }
+    out[n++] = digit;
+  } while (length > 0 && n < 4);
+  return n;
+}
+
+bool writeMqttPacket(uint8_t type, const uint8_t *body, uint16_t length)
+{
+  uint8_t header[5];
+  header[0] = type;
+  uint8_t headerLength = 1 + encodeMqttLength(header + 1, length);
+
+  if (mqttClient.write(header, headerLength) != headerLength ||
+      (length > 0 && mqttClient.write(body, length) != length))
+  {
+    return false;
+  }
+  lastMqttSendMs = millis();
+  return true;
+}
+
+bool sendMqttPublish(InflightRecord &record, bool duplicate)
+{
+  uint8_t body[2 + 64 + 2 + STREAM_PAYLOAD_MAX];
+  uint16_t topicLength = strlen(mqttTopic);
+  uint16_t payloadLength = strlen(record.payload);
+  if (topicLength > 64)
+  {
+    return false;
+  }
+
+  uint16_t n = 0;
+  body[n++] = topicLength >> 8;
+  body[n++] = topicLength & 0xFF;
+  memcpy(body + n, mqttTopic, topicLength);
+  n += topicLength;
+  body[n++] = record.packetId >> 8;
+  body[n++] = record.packetId & 0xFF;
+  memcpy(body + n, record.payload, payloadLength);
+  n += payloadLength;
+
+  // PUBLISH, QoS 1, optional DUP flag on retransmit
+  uint8_t type = 0x32 | (duplicate ? 0x08 : 0x00);
+  record.sentAtUs = micros();
+  record.lastSendMs = millis();
+  return writeMqttPacket(type, body, n);
+}
+
+// Open the TCP session and send CONNECT. The CONNACK is picked up later by
+// pollMqttInput.
+bool connectStreamUplink()
+{
+  if (!mqttClient.connect(mqttBroker, mqttPort, STREAM_CONNECT_TIMEOUT_MS))
+  {
+    LOG_WARN("MQTT broker unreachable, streaming paused");
+    return false;
+  }
+  mqttClient.setNoDelay(true);
+
+  // CONNECT with clean session and client ID
+  uint8_t body[12 + 2 + 32];
+  uint16_t idLength = min((int)strlen(mqttClientId), 32);
+  uint16_t n = 0;
+  const uint8_t variableHeader[10] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02,
+                                      0x00, MQTT_KEEPALIVE_S};
+  memcpy(body, variableHeader, sizeof(variableHeader));
+  n += sizeof(variableHeader);
+  body[n++] = idLength >> 8;
+  body[n++] = idLength & 0xFF;
+  memcpy(body + n, mqttClientId, idLength);
+  n += idLength;
+
+  mqttRxLength = 0;
+  if (!writeMqttPacket(0x10, body, n))
+  {
+    mqttClient.stop();
+    return false;
+  }
+  return true;
+}
+
+// Drop the session and try again after STREAM_RECONNECT_MS
+void pauseStreamUplink()
+{
+  mqttClient.stop();
+  streamState = STREAM_OFFLINE;
+  nextStreamConnectAt = millis() + STREAM_RECONNECT_MS;
+}
+
+bool streamUplinkConnected()
+{
+  return streamState == STREAM_ONLINE && mqttClient.connected();
+}
+
+// True while attendance mode wants the streaming session, connected or not
+bool streamUplinkActive()
+{
+  return streamUplinkConfigured() && streamStarted;
+}
+
+void startStreamingUplink()
+{
+  if (!streamUplinkConfigured())
+  {
+    return;
+  }
+  streamStarted = true;
+  streamState = STREAM_OFFLINE;
+  nextStreamConnectAt = millis();
+}
+
+void stopStreamingUplink()
+{
+  if (streamUplinkConnected())
+  {
+    // Give outstanding acknowledgements a moment to arrive
+    unsigned long start = millis();
+    while (millis() - start < 500)
+    {
+      serviceStreamingUplink();
+    }
+    writeMqttPacket(0xE0, NULL, 0); // DISCONNECT
+  }
+  mqttClient.stop();
+
+  // Anything left in flight falls back to the HTTPS batch path
+  for (int i = 0; i < STREAM_MAX_INFLIGHT; i++)
+  {
+    inflight[i].used = false;
+  }
+  streamState = STREAM_OFFLINE;
+  streamStarted = false;
+  disconnectWiFi();
+}
+
+void handlePubAck(uint16_t packetId)
+{
+  for (int i = 0; i < STREAM_MAX_INFLIGHT; i++)
+  {
+    if (!inflight[i].used || inflight[i].packetId != packetId)
+    {
+      continue;
+    }
+
+    uint32_t ackUs = micros() - inflight[i].sentAtUs;
+    streamStats.acked++;
+    streamStats.totalAckUs += ackUs;
+    streamStats.minAckUs = min(streamStats.minAckUs, ackUs);
+    streamStats.maxAckUs = max(streamStats.maxAckUs, ackUs);
+
+    if (markRecordSynced(inflight[i].flagOffset))
+    {
+      unsyncedCount = max(unsyncedCount - 1, 0);
+    }
+    LOG_INFO("Record streamed, publish-to-ack %.1f ms", ackUs / 1000.0);
+    inflight[i].used = false;
+    return;
+  }
+}
+
+// Parse complete packets out of the receive buffer
+void pollMqttInput()
+{
+  while (mqttClient.available() && mqttRxLength < sizeof(mqttRxBuffer))
+  {
+    mqttRxBuffer[mqttRxLength++] = mqttClient.read();
+  }
+
+  while (mqttRxLength >= 2)
+  {
+    // Broker-to-client packets we care about are all short
+    uint8_t remaining = mqttRxBuffer[1];
+    if (remaining & 0x80 || (size_t)remaining + 2 > sizeof(mqttRxBuffer))
+    {
+      LOG_WARN("Unexpected MQTT packet, reconnecting");
+      mqttRxLength = 0;
+      pauseStreamUplink();
+      return;
+    }
+    uint8_t total = remaining + 2;
+    if (mqttRxLength < total)
+    {
+      return;
+    }
+
+    uint8_t type = mqttRxBuffer[0] & 0xF0;
+    if (type == 0x20 && remaining == 2 && streamState == STREAM_WAIT_CONNACK) // CONNACK
+    {
+      if (mqttRxBuffer[3] != 0x00)
+      {
+        LOG_WARN("MQTT broker refused connection (code %u), streaming paused", mqttRxBuffer[3]);
+        mqttRxLength = 0;
+        pauseStreamUplink();
+        return;
+      }
+      streamState = STREAM_ONLINE;
+      LOG_INFO("Streaming uplink connected to %s:%u", mqttBroker, mqttPort);
+    }
+    else if (type == 0x40 && remaining == 2) // PUBACK
+    {
+      handlePubAck((mqttRxBuffer[2] << 8) | mqttRxBuffer[3]);
+    }
+    // PINGRESP and anything else is ignored
+
+    memmove(mqttRxBuffer, mqttRxBuffer + total, mqttRxLength - total);
+    mqttRxLength -= total;
+  }
+}
+
+// Called on every pass of the scan loop: advances the connection, reads
+// acks, retransmits stale publishes and keeps the session alive. Each step
+// returns quickly so scanning is not held up.
+void serviceStreamingUplink()
+{
+  if (!streamUplinkActive())
+  {
+    return;
+  }
+
+  if (streamState != STREAM_OFFLINE && streamState != STREAM_WAIT_WIFI && !mqttClient.connected())
+  {
+    LOG_WARN("MQTT session dropped");
+    pauseStreamUplink();
+  }
+
+  switch (streamState)
+  {
+  case STREAM_OFFLINE:
+    if ((long)(millis() - nextStreamConnectAt) < 0)
+    {
+      return;
+    }
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      WiFi.begin(ssid, password); // Joins in the background
+    }
+    streamState = STREAM_WAIT_WIFI;
+    streamDeadline = millis() + STREAM_WIFI_WAIT_MS;
+    return;
+
+  case STREAM_WAIT_WIFI:
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      if ((long)(millis() - streamDeadline) >= 0)
+      {
+        LOG_WARN("WiFi not available, streaming paused");
+        pauseStreamUplink();
+      }
+      return;
+    }
+    // The TCP connect can still take up to its timeout; keep it out of a scan
+    if (!fingerprintScanIdle())
+    {
+      return;
+    }
+    if (!connectStreamUplink())
+    {
+      pauseStreamUplink();
+      return;
+    }
+    streamState = STREAM_WAIT_CONNACK;
+    streamDeadline = millis() + STREAM_CONNACK_TIMEOUT_MS;
+    return;
+
+  case STREAM_WAIT_CONNACK:
+    pollMqttInput();
+    if (streamState == STREAM_WAIT_CONNACK && (long)(millis() - streamDeadline) >= 0)
+    {
+      LOG_WARN("No CONNACK from MQTT broker, streaming paused");
+      pauseStreamUplink();
+    }
+    return;
+
+  case STREAM_ONLINE:
+    break;
+  }
+
+  pollMqttInput();
+  if (streamState != STREAM_ONLINE)
+  {
+    return;
+  }
+
+  for (int i = 0; i < STREAM_MAX_INFLIGHT; i++)
+  {
+    InflightRecord &record = inflight[i];
+    if (!record.used || millis() - record.lastSendMs < STREAM_ACK_TIMEOUT_MS)
+    {
+      continue;
+    }
+    if (record.retries >= STREAM_MAX_RETRIES)
+    {
+      // Leave it unsynced for the HTTPS batch path
+      streamStats.expired++;
+      record.used = false;
+      continue;
+    }
+    record.retries++;
+    sendMqttPublish(record, true);
+  }
+
+  if (millis() - lastMqttSendMs >= MQTT_KEEPALIVE_S * 1000UL / 2)
+  {
+    writeMqttPacket(0xC0, NULL, 0); // PINGREQ
+  }
+}
+
+bool streamRecordInFlight(long flagOffset)
+{
+  for (int i = 0; i < STREAM_MAX_INFLIGHT; i++)
+  {
+    if (inflight[i].used && inflight[i].flagOffset == flagOffset)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Publish a freshly saved record. Returns false if it was left for the
+// HTTPS batch path instead.
+bool streamAttendanceRecord(const char *date, const char *studentId, long flagOffset)
+{
+  if (flagOffset < 0 || !streamUplinkConnected())
+  {
+    return false;
+  }
+
+  InflightRecord *slot = NULL;
+  for (int i = 0; i < STREAM_MAX_INFLIGHT; i++)
+  {
+    if (!inflight[i].used)
+    {
+      slot = &inflight[i];
+      break;
+    }
+  }
+  if (slot == NULL)
+  {
+    return false;
+  }
+
+  snprintf(slot->payload, sizeof(slot->payload),
+           "{\"date\":\"%s\",\"student_id\":\"%s\",\"status\":\"present\"}",
+           date, studentId);
+  slot->packetId = nextPacketId;
+  nextPacketId = nextPacketId == 0xFFFF ? 1 : nextPacketId + 1;
+  slot->flagOffset = flagOffset;
+  slot->retries = 0;
+
+  if (!sendMqttPublish(*slot, false))
+  {
+    pauseStreamUplink();
+    return false;
+  }
+  slot->used = true;
+  streamStats.published++;
+  return true;
+}
+
+void showStreamStats()
+{
+  if (!streamUplinkConfigured())
+  {
+    consolePuts("Streaming uplink: disabled");
+    return;
+  }
+  consolePrintf("Streaming uplink: %s\n", streamUplinkConnected() ? "connected" : "offline");
+  consolePrintf("Published: %u, acked: %u, expired: %u\n",
+                (unsigned)streamStats.published, (unsigned)streamStats.acked, (unsigned)streamStats.expired);
+  if (streamStats.acked > 0)
+  {
+    consolePrintf("Publish-to-ack ms (min/avg/max): %.1f / %.1f / %.1f\n",
+                  streamStats.minAckUs / 1000.0,
+                  (double)(streamStats.totalAckUs / streamStats.acked) / 1000.0,
+                  streamStats.maxAckUs / 1000.0);
+  }
+}
+
+uint8_t getFingerprintEnroll(uint8_t id)
+{
+  int p = -1;
+  consolePrintf("Waiting for valid finger to enroll as #%u\n", id);
+  while (p != FINGERPRINT_OK)
+  {
+    p = finger.getImage();
+    switch (p)
+    {
+    case FINGERPRINT_OK:
+      consolePuts("Image taken");
+      break;
+    case FINGERPRINT_NOFINGER:
+      consolePuts(".");
+      break;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      consolePuts("Communication error");
+      break;
+    case FINGERPRINT_IMAGEFAIL:
+      consolePuts("Imaging error");
+      break;
+    default:
+      consolePuts("Unknown error");
+      break;
+    }
+
+    if (p == FINGERPRINT_OK)
+    {
+      consolePuts("Stored!");
+      indicateSuccess(); // Success indicator
+    }
+    else
+    {
+      // In failure cases
+      indicateFailure(); // Failure indicator
+    }
+  }
+
+  p = finger.image2Tz(1);
+  switch (p)
+  {
+  case FINGERPRINT_OK:
+    consolePuts("Image converted");
+    break;
+  case FINGERPRINT_IMAGEMESS:
+    consolePuts("Image too messy");
+    return p;
+  case FINGERPRINT_PACKETRECIEVEERR:
+    consolePuts("Communication error");
+    return p;
+  case FINGERPRINT_FEATUREFAIL:
+    consolePuts("Could not find fingerprint features");
+    return p;
+  case FINGERPRINT_INVALIDIMAGE:
+    consolePuts("Could not find fingerprint features");
+    return p;
+  default:
+    consolePuts("Unknown error");
+    return p;
+  }
+
+  consolePuts("Remove finger");
+  delay(2000);
+  p = 0;
+  while (p != FINGERPRINT_NOFINGER)
+  {
+    p = finger.getImage();
+  }
+
+  consolePuts("Place same finger again");
+  p = -1;
+  while (p != FINGERPRINT_OK)
+  {
+    p = finger.getImage();
+    switch (p)
+    {
+    case FINGERPRINT_OK:
+      consolePuts("Image taken");
+      break;
+    case FINGERPRINT_NOFINGER:
+      consolePuts(".");
+      break;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      consolePuts("Communication error");
+      break;
+    case FINGERPRINT_IMAGEFAIL:
+      consolePuts("Imaging error");
+      break;
+    default:
+      consolePuts("Unknown error");
+      break;
+    }
+  }
+
+  p = finger.image2Tz(2);
+  switch (p)
+  {
+  case FINGERPRINT_OK:
+    consolePuts("Image converted");
+    break;
+  case FINGERPRINT_IMAGEMESS:
+    consolePuts("Image too messy");
+    return p;
+  case FINGERPRINT_PACKETRECIEVEERR:
+    consolePuts("Communication error");
+    return p;
+  case FINGERPRINT_FEATUREFAIL:
+    consolePuts("Could not find fingerprint features");
+    return p;
+  case FINGERPRINT_INVALIDIMAGE:
+    consolePuts("Could not find fingerprint features");
+    return p;
+  default:
+    consolePuts("Unknown error");
+    return p;
+  }
+
+  p = finger.createModel();
+  if (p == FINGERPRINT_OK)
+  {
+    consolePuts("Prints matched!");
+  }
+  else if (p == FINGERPRINT_PACKETRECIEVEERR)
+  {
+    consolePuts("Communication error");
+    return p;
+  }
+  else if (p == FINGERPRINT_ENROLLMISMATCH)
+  {
+    consolePuts("Fingerprints did not match");
+    return p;
+  }
+  else
+  {
+    consolePuts("Unknown error");
+    return p;
+  }
+
+  p = finger.storeModel(id);
+  if (p == FINGERPRINT_OK)
+  {
+    consolePuts("Stored!");
+  }
+  else if (p == FINGERPRINT_PACKETRECIEVEERR)
+  {
+    consolePuts("Communication error");
+    return p;
+  }
+  else if (p == FINGERPRINT_BADLOCATION)
+  {
+    consolePuts("Could not store in that location");
+    return p;
+  }
+  else if (p == FINGERPRINT_FLASHERR)
+  {
+    consolePuts("Error writing to flash");
+    return p;
+  }
+  else
+  {
+    consolePuts("Unknown error");
+    return p;
+  }
+
+  return true;
+}
+
+void enrollFingerprint()
+{
+  consolePuts("Ready to enroll a fingerprint!");
+  consolePuts("Please type in the ID # (from 1 to 127) you want to save this finger as...");
+  uint8_t id = readnumber();
+  if (id == 0)
+  { // ID #0 not allowed
+    return;
+  }
+  consolePrintf("Enrolling ID #%u\n", id);
+
+  while (!getFingerprintEnroll(id))
+    ;
+}
+
+// Function to add attendance
+
+void addAttendance(int fingerprintID)
+{
+  char studentId[8];
+
+  if (fingerprintID)
+  {
+
+    LOG_INFO("Welcome %d", fingerprintID);
+    snprintf(studentId, sizeof(studentId), "%d", fingerprintID);
+  }
+  else
+  {
+    LOG_WARN("Unknown fingerprint ID");
+    return;
+  }
+
+  // Save attendance to local file (passing only studentId)
+  long flagOffset = saveAttendanceToFile(studentId);
+  if (flagOffset >= 0)
+  {
+    if (analyticsLoaded)
+    {
+      recordAnalytics(currentDate, fingerprintID);
+    }
+  }
+
+  // Push it upstream right away when the streaming session is up
+  streamAttendanceRecord(currentDate, studentId, flagOffset);
+  sampleHeapWatermark();
+
+  // LED success indication
+  indicateSuccess();
+}
+
+void viewStoredRecords()
+{
+  File file = SPIFFS.open(attendanceFilePath, FILE_READ);
+  if (!file)
+  {
+    consolePuts("Failed to open attendance file");
+    return;
+  }
+
+  consolePuts("\n--- Stored Attendance Records ---");
+
+  // Copy the file to the console in fixed-size chunks
+  uint8_t chunk[64];
+  while (file.available())
+  {
+    size_t length = file.read(chunk, sizeof(chunk));
+    consoleWrite(chunk, length);
+  }
+
+  file.close();
+  consolePuts("--- End of Records ---\n");
+}
+
+// Function to clear attendance data
+void clearAttendanceData()
+{
+  consolePuts("Are you sure you want to clear all attendance records? (Y/N)");
+  consolePuts("WARNING: This will delete all attendance data!");
+
+  const char *confirmation = readInput();
+  if (strcasecmp(confirmation, "Y") == 0)
+  {
+    // Double confirmation for safety
+    consolePuts("ALL ATTENDANCE RECORDS WILL BE PERMANENTLY DELETED!");
+    consolePuts("Type 'CONFIRM' to proceed:");
+
+    const char *finalConfirmation = readInput();
+    if (strcmp(finalConfirmation, "CONFIRM") == 0)
+    {
+      // Delete the old file
+      if (SPIFFS.remove(attendanceFilePath))
+      {
+        // Create a new file with only the header
+        File file = SPIFFS.open(attendanceFilePath, FILE_WRITE);
+        if (file)
+        {
+          // Write CSV headers
+          file.println(attendanceLogHeader);
+          uint32_t logSize = file.size();
+          file.close();
+          unsyncedCount = 0;
+          checkpointSyncJournal(logSize);
+          resetAnalytics();
+          analyticsLoaded = true;
+
+          consolePuts("All attendance records have been cleared successfully!");
+          indicateSuccess(); // Visual confirmation
+        }
+        else
+        {
+          consolePuts("Error: Failed to create a new attendance file");
+          indicateFailure();
+        }
+      }
+      else
+      {
+        consolePuts("Error: Failed to remove the old attendance file");
+        indicateFailure();
+      }
+    }
+    else
+    {
+      consolePuts("Operation canceled: Confirmation text didn't match");
+    }
+  }
+  else
+  {
+    consolePuts("Operation canceled");
+  }
+
+  delay(2000);
+}
+
+void enrollMode()
+{
+  consolePuts("Entering Enroll Mode...");
+  consolePuts("Follow instructions on serial monitor");
+
+  while (true)
+  {
+    enrollFingerprint();
+
+    consolePuts("\nEnrollment options:");
+    consolePuts("1. Enroll another fingerprint");
+    consolePuts("2. Return to main menu");
+
+    const char *option = readInput();
+    if (strcmp(option, "2") == 0)
+    {
+      break;
+    }
+  }
+}
+
+void setCurrentDate()
+{
+  consolePuts("Enter today's date in DD/MM format (e.g., 19/5):");
+  const char *dateInput = readInput();
+
+  // Basic validation - check if the input matches the expected format
+  if (dateInput[0] != '\0' && strlen(dateInput) < sizeof(currentDate))
+  {
+    snprintf(currentDate, sizeof(currentDate), "%s", dateInput);
+    consolePrintf("Date set to: %s\n", currentDate);
+  }
+  else
+  {
+    consolePrintf("Invalid date format. Using default date: %s\n", currentDate);
+  }
+}
+
+void attendanceMode()
+{
+  // First set the date for attendance
+  setCurrentDate();
+
+  consolePrintf("Entering Attendance Mode for date: %s\n", currentDate);
+  consolePuts("Place Finger... (Press 'X' to exit)");
+
+  unsigned long lastScanAt = millis();
+  startStreamingUplink();
+
+  while (true)
+  {
+    // Wait for a fingerprint to be detected
+    int fingerprintID = -1;
+    while (fingerprintID == -1)
+    {
+      // Each pass sends or collects at most one sensor command, so the
+      // uplink and console are serviced while the sensor works
+      fingerprintID = serviceFingerprintScan();
+      serviceStreamingUplink();
+
+      // Use quiet periods between students to drain the sync backlog; a
+      // scheduler still in backoff does nothing and leaves the prompt alone
+      if (fingerprintID == -1 && fingerprintScanIdle() && millis() - lastScanAt >= SYNC_IDLE_GAP_MS &&
+          unsyncedCount > 0 && serviceSyncScheduler(true, true))
+      {
+        lastScanAt = millis();
+        consolePuts("Place Finger... (Press 'X' to exit)");
+      }
+
+      // Check if there's a request to exit from Serial
+      if (Serial.available())
+      {
+        const char *cmd = readInput();
+        if (strcasecmp(cmd, "X") == 0)
+        {
+          consolePuts("Exiting Attendance Mode...");
+          cancelFingerprintScan();
+          stopStreamingUplink();
+          return;
+        }
+      }
+    }
+
+    // Fingerprint found, add attendance
+    addAttendance(fingerprintID);
+    lastScanAt = millis();
+    delay(2000); // Delay before next scan
+    consolePuts("Place Finger... (Press 'X' to exit)");
+  }
+}
+
+void clearAllFingerprints()
+{
+  consolePuts("Are you sure you want to clear all fingerprints? (Y/N)");
+
+  const char *confirmation = readInput();
+  if (strcasecmp(confirmation, "Y") == 0)
+  {
+    consolePuts("Clearing all fingerprints...");
+
+    uint8_t p = finger.emptyDatabase();
+    if (p == FINGERPRINT_OK)
+    {
+      consolePuts("All fingerprints cleared successfully!");
+    }
+    else
+    {
+      consolePuts("Failed to clear fingerprints.");
+    }
+  }
+  else
+  {
+    consolePuts("Clear operation canceled.");
+  }
+  delay(2000);
+}
+
+// ---------------------------------------------------------------------------
+// Template backup, restore and cloning
+//
+// Templates are streamed straight over the sensor UART using the raw packet
+// protocol, since the library's packet struct only holds 64 data bytes. The
+// archive on SPIFFS is a small header followed by one record per template:
+//   [id:2][length:2][checksum:2][template bytes]
+// and an end record [0xFFFF][count:2][~count:2], so a truncated archive can
+// be told from a complete one. A backup is written to a temporary file and
+// only swapped in once the export completed.
+// ---------------------------------------------------------------------------
+
+// Raw sensor command codes not exposed by the library
+#define SENSOR_CMD_STORE 0x06
+#define SENSOR_CMD_LOAD 0x07
+#define SENSOR_CMD_UPLOAD 0x08
+#define SENSOR_CMD_DOWNLOAD 0x09
+#define SENSOR_CMD_READINDEX 0x1F
+
+#define SENSOR_PACKET_MAX 256
+#define TEMPLATE_MAX_BYTES 1024
+#define TEMPLATE_SLOTS 128 // Enrollment uses IDs 1-127
+
+const uint8_t templateArchiveMagic[4] = {'F', 'P', 'T', 'A'};
+const uint8_t templateArchiveVersion = 2;
+const char *templateArchiveTempPath = "/templates.tmp";
+const char *templateArchiveOldPath = "/templates.old";
+
+#define TEMPLATE_ARCHIVE_END 0xFFFF
+
+// Sensor-side checksum: 16-bit sum of all bytes
+uint16_t templateChecksum(const uint8_t *data, uint16_t length)
+{
+  uint16_t sum = 0;
+  for (uint16_t i = 0; i < length; i++)
+  {
+    sum += data[i];
+  }
+  return sum;
+}
+
+// Drop any stale bytes left over from a previous exchange
+void drainSensorSerial()
+{
+  while (FINGERPRINT_SERIAL.available())
+  {
+    FINGERPRINT_SERIAL.read();
+  }
+}
+
+void sendSensorPacket(uint8_t type, const uint8_t *data, uint16_t length)
+{
+  uint16_t wireLength = length + 2; // Payload plus checksum
+  uint8_t header[9] = {0xEF, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, type,
+                       (uint8_t)(wireLength >> 8), (uint8_t)(wireLength & 0xFF)};
+
+  uint16_t sum = type + (wireLength >> 8) + (wireLength & 0xFF) + templateChecksum(data, length);
+  uint8_t trailer[2] = {(uint8_t)(sum >> 8), (uint8_t)(sum & 0xFF)};
+
+  FINGERPRINT_SERIAL.write(header, sizeof(header));
+  FINGERPRINT_SERIAL.write(data, length);
+  FINGERPRINT_SERIAL.write(trailer, sizeof(trailer));
+}
+
+// Incremental packet parser, fed one byte at a time so replies can be
+// collected without blocking
+#define SENSOR_PACKET_PENDING -2
+
+struct SensorPacketParser
+{
+  uint8_t header[9];
+  uint16_t idx;
+  uint16_t payloadLength;
+  uint16_t sum;
+  uint8_t *data;
+  uint16_t maxLength;
+};
+
+void beginSensorPacket(SensorPacketParser &parser, uint8_t *data, uint16_t maxLength)
+{
+  parser.idx = 0;
+  parser.payloadLength = 0;
+  parser.sum = 0;
+  parser.data = data;
+  parser.maxLength = maxLength;
+}
+
+// Returns the packet type once complete, SENSOR_PACKET_PENDING while more
+// bytes are needed, or -1 on overflow or checksum mismatch
+int feedSensorPacket(SensorPacketParser &parser, uint8_t b)
+{
+  if (parser.idx < sizeof(parser.header))
+  {
+    // Resynchronise on the start code
+    if ((parser.idx == 0 && b != 0xEF) || (parser.idx == 1 && b != 0x01))
+    {
+      parser.idx = 0;
+      return SENSOR_PACKET_PENDING;
+    }
+    parser.header[parser.idx++] = b;
+    if (parser.idx == sizeof(parser.header))
+    {
+      parser.payloadLength = ((parser.header[7] << 8) | parser.header[8]);
+      if (parser.payloadLength < 2 || parser.payloadLength - 2 > parser.maxLength)
+      {
+        return -1;
+      }
+      parser.payloadLength -= 2;
+      parser.sum = parser.header[6] + parser.header[7] + parser.header[8];
+    }
+    return SENSOR_PACKET_PENDING;
+  }
+
+  uint16_t pos = parser.idx - sizeof(parser.header);
+  if (pos < parser.payloadLength)
+  {
+    parser.data[pos] = b;
+    parser.sum += b;
+  }
+  else if (pos == parser.payloadLength && b != (parser.sum >> 8))
+  {
+    return -1;
+  }
+  else if (pos == parser.payloadLength + 1)
+  {
+    return (b == (parser.sum & 0xFF)) ? parser.header[6] : -1;
+  }
+  parser.idx++;
+  return SENSOR_PACKET_PENDING;
+}
+
+// Read one packet from the sensor. Returns the packet type, or -1 on
+// timeout, overflow or checksum mismatch.
+int readSensorPacket(uint8_t *data, uint16_t maxLength, uint16_t *length, uint16_t timeout)
+{
+  SensorPacketParser parser;
+  beginSensorPacket(parser, data, maxLength);
+  unsigned long start = millis();
+
+  while (millis() - start < timeout)
+  {
+    if (!FINGERPRINT_SERIAL.available())
+    {
+      continue;
+    }
+    int type = feedSensorPacket(parser, FINGERPRINT_SERIAL.read());
+    if (type != SENSOR_PACKET_PENDING)
+    {
+      *length = parser.payloadLength;
+      return type;
+    }
+  }
+  return -1;
+}
+
+// Wait for an acknowledge packet and return its confirmation code
+uint8_t readSensorAck(uint8_t *reply, uint16_t maxLength, uint16_t *replyLength, uint16_t timeout)
+{
+  uint16_t length = 0;
+  int type = readSensorPacket(reply, maxLength, &length, timeout);
+  if (type < 0)
+  {
+    return FINGERPRINT_TIMEOUT;
+  }
+  if (type != FINGERPRINT_ACKPACKET || length == 0)
+  {
+    return FINGERPRINT_BADPACKET;
+  }
+  if (replyLength)
+  {
+    *replyLength = length;
+  }
+  return reply[0];
+}
+
+uint8_t sensorCommand(const uint8_t *cmd, uint16_t length, uint8_t *reply, uint16_t maxLength, uint16_t timeout)
+{
+  sendSensorPacket(FINGERPRINT_COMMANDPACKET, cmd, length);
+  return readSensorAck(reply, maxLength, NULL, timeout);
+}
+
+void sendLoadCommand(uint16_t id)
+{
+  uint8_t cmd[4] = {SENSOR_CMD_LOAD, 0x01, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF)};
+  sendSensorPacket(FINGERPRINT_COMMANDPACKET, cmd, sizeof(cmd));
+}
+
+void sendStoreCommand(uint16_t id)
+{
+  uint8_t cmd[4] = {SENSOR_CMD_STORE, 0x01, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF)};
+  sendSensorPacket(FINGERPRINT_COMMANDPACKET, cmd, sizeof(cmd));
+}
+
+// Build the list of occupied slots. Uses the index table when the module
+// supports it, otherwise probes each slot with a load.
+uint16_t findOccupiedSlots(uint16_t *ids, uint16_t maxIds)
+{
+  uint8_t reply[40];
+  uint16_t found = 0;
+
+  drainSensorSerial();
+  uint8_t cmd[2] = {SENSOR_CMD_READINDEX, 0x00}; // Page 0 covers slots 0-255
+  uint16_t replyLength = 0;
+  sendSensorPacket(FINGERPRINT_COMMANDPACKET, cmd, sizeof(cmd));
+  if (readSensorAck(reply, sizeof(reply), &replyLength, 1000) == FINGERPRINT_OK && replyLength >= 33)
+  {
+    for (uint16_t id = 1; id < TEMPLATE_SLOTS && found < maxIds; id++)
+    {
+      if (reply[1 + id / 8] & (1 << (id % 8)))
+      {
+        ids[found++] = id;
+      }
+    }
+    return found;
+  }
+
+  consolePuts("Index table not supported, probing slots...");
+  drainSensorSerial();
+  for (uint16_t id = 1; id < TEMPLATE_SLOTS && found < maxIds; id++)
+  {
+    if (finger.loadModel(id) == FINGERPRINT_OK)
+    {
+      ids[found++] = id;
+    }
+  }
+  return found;
+}
+
+// Receive the data packets that follow an upload command
+bool receiveTemplateData(uint8_t *buffer, uint16_t *length)
+{
+  uint8_t packet[SENSOR_PACKET_MAX];
+  uint16_t total = 0;
+
+  while (true)
+  {
+    uint16_t packetLength = 0;
+    int type = readSensorPacket(packet, sizeof(packet), &packetLength, 1000);
+    if (type != FINGERPRINT_DATAPACKET && type != FINGERPRINT_ENDDATAPACKET)
+    {
+      return false;
+    }
+    if (total + packetLength > TEMPLATE_MAX_BYTES)
+    {
+      return false;
+    }
+    memcpy(buffer + total, packet, packetLength);
+    total += packetLength;
+
+    if (type == FINGERPRINT_ENDDATAPACKET)
+    {
+      *length = total;
+      return true;
+    }
+  }
+}
+
+// Download a template into char buffer 1, split into data packets
+bool sendTemplateData(const uint8_t *buffer, uint16_t length)
+{
+  uint8_t reply[16];
+  uint8_t cmd[2] = {SENSOR_CMD_DOWNLOAD, 0x01};
+  if (sensorCommand(cmd, sizeof(cmd), reply, sizeof(reply), 1000) != FINGERPRINT_OK)
+  {
+    return false;
+  }
+
+  uint16_t chunk = finger.packet_len ? finger.packet_len : 128;
+  for (uint16_t offset = 0; offset < length; offset += chunk)
+  {
+    uint16_t n = min((uint16_t)(length - offset), chunk);
+    uint8_t type = (offset + n >= length) ? FINGERPRINT_ENDDATAPACKET : FINGERPRINT_DATAPACKET;
+    sendSensorPacket(type, buffer + offset, n);
+  }
+  return true;
+}
+
+// Stream all occupied slots out of the sensor. The load for the next slot is
+// issued before the current template is handed to the sink, so the sensor
+// reads its flash while we write ours.
+typedef bool (*TemplateSink)(uint16_t id, const uint8_t *data, uint16_t length, void *ctx);
+
+uint16_t exportTemplates(TemplateSink sink, void *ctx, uint16_t *found = NULL)
+{
+  static uint16_t ids[TEMPLATE_SLOTS];
+  static uint8_t templateData[TEMPLATE_MAX_BYTES];
+  uint8_t reply[16];
+
+  finger.getParameters();
+  uint16_t total = findOccupiedSlots(ids, TEMPLATE_SLOTS);
+  if (found)
+  {
+    *found = total;
+  }
+  if (total == 0)
+  {
+    consolePuts("No templates stored on the sensor.");
+    return 0;
+  }
+  consolePrintf("Exporting %u templates...\n", total);
+
+  uint16_t exported = 0;
+  drainSensorSerial();
+  sendLoadCommand(ids[0]);
+
+  for (uint16_t i = 0; i < total; i++)
+  {
+    uint8_t p = readSensorAck(reply, sizeof(reply), NULL, 1000);
+    if (p != FINGERPRINT_OK)
+    {
+      consolePrintf("Failed to load template #%u (code %u)\n", ids[i], p);
+      drainSensorSerial();
+      if (i + 1 < total)
+      {
+        sendLoadCommand(ids[i + 1]);
+      }
+      continue;
+    }
+
+    uint8_t cmd[2] = {SENSOR_CMD_UPLOAD, 0x01};
+    uint16_t length = 0;
+    if (sensorCommand(cmd, sizeof(cmd), reply, sizeof(reply), 1000) != FINGERPRINT_OK ||
+        !receiveTemplateData(templateData, &length))
+    {
+      consolePrintf("Failed to upload template #%u\n", ids[i]);
+      drainSensorSerial();
+      if (i + 1 < total)
+      {
+        sendLoadCommand(ids[i + 1]);
+      }
+      continue;
+    }
+
+    // Pipeline: sensor starts loading the next slot while we store this one
+    if (i + 1 < total)
+    {
+      sendLoadCommand(ids[i + 1]);
+    }
+
+    if (sink(ids[i], templateData, length, ctx))
+    {
+      exported++;
+    }
+  }
+
+  return exported;
+}
+
+// Write one template into the sensor. The store command is left in flight so
+// the caller can fetch the next template while the sensor writes its flash.
+bool beginImportTemplate(uint16_t id, const uint8_t *data, uint16_t length)
+{
+  if (!sendTemplateData(data, length))
+  {
+    return false;
+  }
+  sendStoreCommand(id);
+  return true;
+}
+
+bool finishImportTemplate(uint16_t id)
+{
+  uint8_t reply[16];
+  uint8_t p = readSensorAck(reply, sizeof(reply), NULL, 2000);
+  if (p != FINGERPRINT_OK)
+  {
+    consolePrintf("Failed to store template #%u (code %u)\n", id, p);
+    return false;
+  }
+  return true;
+}
+
+bool writeTemplateRecord(uint16_t id, const uint8_t *data, uint16_t length, void *ctx)
+{
+  File *file = (File *)ctx;
+  uint16_t sum = templateChecksum(data, length);
+  uint8_t header[6] = {(uint8_t)(id >> 8), (uint8_t)(id & 0xFF),
+                       (uint8_t)(length >> 8), (uint8_t)(length & 0xFF),
+                       (uint8_t)(sum >> 8), (uint8_t)(sum & 0xFF)};
+  if (file->write(header, sizeof(header)) != sizeof(header) ||
+      file->write(data, length) != length)
+  {
+    consolePrintf("Failed to write template #%u to archive\n", id);
+    return false;
+  }
+  return true;
+}
+
+bool writeTemplateTrailer(File &file, uint16_t count)
+{
+  uint16_t check = ~count;
+  uint8_t trailer[6] = {0xFF, 0xFF, (uint8_t)(count >> 8), (uint8_t)(count & 0xFF),
+                        (uint8_t)(check >> 8), (uint8_t)(check & 0xFF)};
+  return file.write(trailer, sizeof(trailer)) == sizeof(trailer);
+}
+
+// Read the next record from the archive. The end record comes back with
+// *id set to TEMPLATE_ARCHIVE_END and *length holding the record count.
+// Returns false at end of file or on a corrupt record.
+bool readTemplateRecord(File &file, uint16_t *id, uint8_t *data, uint16_t *length)
+{
+  uint8_t header[6];
+  if (file.read(header, sizeof(header)) != sizeof(header))
+  {
+    return false;
+  }
+  *id = (header[0] << 8) | header[1];
+  *length = (header[2] << 8) | header[3];
+  uint16_t sum = (header[4] << 8) | header[5];
+
+  if (*id == TEMPLATE_ARCHIVE_END)
+  {
+    return sum == (uint16_t)~*length;
+  }
+
+  if (*length == 0 || *length > TEMPLATE_MAX_BYTES ||
+      file.read(data, *length) != *length ||
+      templateChecksum(data, *length) != sum)
+  {
+    consolePuts("Corrupt record in template archive");
+    return false;
+  }
+  return true;
+}
+
+// Check an archive from its header to its end record. Returns the number of
+// templates, or -1 if the archive is corrupt or was cut short.
+int verifyTemplateArchive(File &file)
+{
+  static uint8_t templateData[TEMPLATE_MAX_BYTES];
+
+  uint8_t magic[5];
+  if (file.read(magic, sizeof(magic)) != sizeof(magic) ||
+      memcmp(magic, templateArchiveMagic, sizeof(templateArchiveMagic)) != 0 ||
+      magic[4] != templateArchiveVersion)
+  {
+    return -1;
+  }
+
+  int count = 0;
+  uint16_t id = 0;
+  uint16_t length = 0;
+  while (file.available())
+  {
+    if (!readTemplateRecord(file, &id, templateData, &length))
+    {
+      return -1;
+    }
+    if (id == TEMPLATE_ARCHIVE_END)
+    {
+      return (length == count && !file.available()) ? count : -1;
+    }
+    count++;
+  }
+  return -1; // No end record
+}
+
+void backupTemplatesToFlash()
+{
+  File file = SPIFFS.open(templateArchiveTempPath, FILE_WRITE);
+  if (!file)
+  {
+    consolePuts("Failed to create template archive");
+    return;
+  }
+  file.write(templateArchiveMagic, sizeof(templateArchiveMagic));
+  file.write(&templateArchiveVersion, 1);
+
+  unsigned long start = millis();
+  uint16_t total = 0;
+  uint16_t exported = exportTemplates(writeTemplateRecord, &file, &total);
+  bool complete = exported > 0 && exported == total && writeTemplateTrailer(file, exported);
+  file.close();
+
+  if (!complete)
+  {
+    SPIFFS.remove(templateArchiveTempPath);
+    consolePrintf("Backup incomplete (%u of %u templates); previous archive kept\n", exported, total);
+    indicateFailure();
+    return;
+  }
+
+  // Keep the previous archive until the new one is in place; restore falls
+  // back to either file if a power cut lands between the renames
+  SPIFFS.remove(templateArchiveOldPath);
+  if (SPIFFS.exists(templateArchivePath))
+  {
+    SPIFFS.rename(templateArchivePath, templateArchiveOldPath);
+  }
+  SPIFFS.rename(templateArchiveTempPath, templateArchivePath);
+  SPIFFS.remove(templateArchiveOldPath);
+
+  consolePrintf("Backed up %u templates to %s in %.1f s\n", exported, templateArchivePath,
+                (millis() - start) / 1000.0);
+  indicateSuccess();
+}
+
+void restoreTemplatesFromFlash()
+{
+  static uint8_t templateData[TEMPLATE_MAX_BYTES];
+
+  // The archive, or the files left by an interrupted swap, newest first
+  const char *candidates[] = {templateArchivePath, templateArchiveTempPath, templateArchiveOldPath};
+  File file;
+  int expected = -1;
+  for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && expected < 0; i++)
+  {
+    file = SPIFFS.open(candidates[i], FILE_READ);
+    if (!file)
+    {
+      continue;
+    }
+    expected = verifyTemplateArchive(file);
+    if (expected < 0)
+    {
+      consolePrintf("%s is incomplete or corrupt, skipping\n", candidates[i]);
+      file.close();
+    }
+    else if (i > 0)
+    {
+      consolePrintf("Using %s left by an interrupted backup\n", candidates[i]);
+    }
+  }
+  if (expected < 0)
+  {
+    consolePuts("No complete template archive found");
+    return;
+  }
+  file.seek(5); // Past magic and version
+
+  finger.getParameters();
+  drainSensorSerial();
+
+  unsigned long start = millis();
+  uint16_t restored = 0;
+  uint16_t id = 0;
+  uint16_t length = 0;
+  bool pending = false;
+  uint16_t pendingId = 0;
+
+  while (readTemplateRecord(file, &id, templateData, &length) && id != TEMPLATE_ARCHIVE_END)
+  {
+    // The next record has been read from flash while the previous store ran
+    if (pending && finishImportTemplate(pendingId))
+    {
+      restored++;
+    }
+    pending = beginImportTemplate(id, templateData, length);
+    pendingId = id;
+    if (!pending)
+    {
+      consolePrintf("Failed to download template #%u\n", id);
+      drainSensorSerial();
+    }
+  }
+  if (pending && finishImportTemplate(pendingId))
+  {
+    restored++;
+  }
+  file.close();
+
+  consolePrintf("Restored %u of %d templates in %.1f s\n", restored, expected, (millis() - start) / 1000.0);
+  if (restored > 0)
+  {
+    indicateSuccess();
+  }
+}
+
+// Serial export format, one template per line:
+//   TPL <id> <checksum hex> <template hex>
+// terminated by "TPL END <count>". The same lines can be fed back to
+// importTemplatesFromSerial on another device to clone it.
+bool printTemplateRecord(uint16_t id, const uint8_t *data, uint16_t length, void *ctx)
+{
+  char chunk[65];
+  consolePrintf("TPL %u %04X ", id, templateChecksum(data, length));
+  for (uint16_t i = 0; i < length; i += 32)
+  {
+    uint16_t n = min((uint16_t)(length - i), (uint16_t)32);
+    for (uint16_t j = 0; j < n; j++)
+    {
+      sprintf(chunk + j * 2, "%02X", data[i + j]);
+    }
+    consoleWrite((const uint8_t *)chunk, n * 2);
+  }
+  consolePuts("");
+  return true;
+}
+
+void exportTemplatesToSerial()
+{
+  consolePuts("--- Template Export ---");
+  uint16_t exported = exportTemplates(printTemplateRecord, NULL);
+  consolePrintf("TPL END %u\n", exported);
+}
 
-  p = finger.storeModel(id);
-  if (p == FINGERPRINT_OK)
+// Parse a "TPL <id> <checksum> <hex>" line. Returns false if malformed.
+bool parseTemplateLine(const char *line, uint16_t *id, uint8_t *data, uint16_t *length)
+{
+  unsigned int parsedId = 0;
+  unsigned int sum = 0;
+  int offset = 0;
+  if (sscanf(line, "TPL %u %x %n", &parsedId, &sum, &offset) != 2 || offset == 0)
   {
-    Serial.println("Stored!");
+    return false;
   }
-  else if (p == FINGERPRINT_PACKETRECIEVEERR)
+
+  const char *hex = line + offset;
+  uint16_t n = 0;
+  while (hex[0] && hex[1] && n < TEMPLATE_MAX_BYTES)
   {
-    Serial.println("Communication error");
-    return p;
+    unsigned int byteValue = 0;
+    if (sscanf(hex, "%2x", &byteValue) != 1)
+    {
+      return false;
+    }
+    data[n++] = byteValue;
+    hex += 2;
   }
-  else if (p == FINGERPRINT_BADLOCATION)
+
+  if (n == 0 || parsedId == 0 || parsedId >= TEMPLATE_SLOTS || templateChecksum(data, n) != sum)
   {
-    Serial.println("Could not store in that location");
-    return p;
+    return false;
   }
-  else if (p == FINGERPRINT_FLASHERR)
+  *id = parsedId;
+  *length = n;
+  return true;
+}
+
+void importTemplatesFromSerial()
+{
+  static uint8_t templateData[TEMPLATE_MAX_BYTES];
+
+  consolePuts("Send template lines now (TPL <id> <checksum> <hex>), ending with 'TPL END'");
+
+  finger.getParameters();
+  drainSensorSerial();
+
+  uint16_t restored = 0;
+  uint16_t rejected = 0;
+  bool pending = false;
+  uint16_t pendingId = 0;
+
+  while (true)
   {
-    Serial.println("Error writing to flash");
-    return p;
+    // Reading the next line overlaps with the previous store on the sensor
+    const char *line = readInput();
+    if (strncmp(line, "TPL END", 7) == 0)
+    {
+      break;
+    }
+
+    uint16_t id = 0;
+    uint16_t length = 0;
+    if (!parseTemplateLine(line, &id, templateData, &length))
+    {
+      rejected++;
+      continue;
+    }
+
+    if (pending && finishImportTemplate(pendingId))
+    {
+      restored++;
+    }
+    pending = beginImportTemplate(id, templateData, length);
+    pendingId = id;
+    if (!pending)
+    {
+      consolePrintf("Failed to download template #%u\n", id);
+      drainSensorSerial();
+    }
   }
-  else
+  if (pending && finishImportTemplate(pendingId))
   {
-    Serial.println("Unknown error");
-    return p;
+    restored++;
   }
 
-  return true;
+  consolePrintf("Imported %u templates, rejected %u lines\n", restored, rejected);
 }
 
-void enrollFingerprint()
-{
-  Serial.println("Ready to enroll a fingerprint!");
-  Serial.println("Please type in the ID # (from 1 to 127) you want to save this finger as...");
-  uint8_t id = readnumber();
-  if (id == 0)
-  { // ID #0 not allowed
-    return;
-  }
-  Serial.println("Enrolling ID #" + String(id));
+const MenuCommand templateMenu[] = {
+    {"Backup templates to flash", backupTemplatesToFlash},
+    {"Restore templates from flash", restoreTemplatesFromFlash},
+    {"Export templates over serial", exportTemplatesToSerial},
+    {"Import templates over serial", importTemplatesFromSerial},
+};
 
-  while (!getFingerprintEnroll(id))
-    ;
+void templateTransferMode()
+{
+  runSubmenu("Template transfer options:", templateMenu, MENU_SIZE(templateMenu));
 }
 
-int getFingerprintID()
+// ---------------------------------------------------------------------------
+// Sensor link: baud negotiation and split-phase scan driver
+//
+// At boot the link is probed at the last known rate, then the common rates,
+// and raised to 115200 when the module is found lower. The module keeps the
+// new rate in its own flash; the host keeps it in Preferences so the next
+// boot finds it on the first probe. Repeated timeouts during scanning mean
+// the two sides disagree (e.g. the sensor was power-cycled onto a different
+// rate), so the probe runs again, one rate per scan pass; a sweep that finds
+// nothing is not repeated for SENSOR_REPROBE_BACKOFF_MS.
+//
+// Scans are driven as a state machine: each command is sent and its reply
+// collected on a later poll, so the attendance loop keeps servicing the
+// uplink and console while the sensor captures and matches. Each command's
+// round trip is timed from send to reply.
+// ---------------------------------------------------------------------------
+
+#define SENSOR_CMD_GETIMAGE 0x01
+#define SENSOR_CMD_IMAGE2TZ 0x02
+#define SENSOR_CMD_HISPEEDSEARCH 0x1B
+#define SENSOR_CMD_VERIFYPASSWORD 0x13
+
+#define SENSOR_DEFAULT_BAUD 57600
+#define SENSOR_TARGET_BAUD 115200
+#define SENSOR_BAUD_STEP 9600 // Module rates are multiples of 9600
+#define SENSOR_REPLY_TIMEOUT_MS 1000 // Same as the library default
+#define SENSOR_LINK_ERROR_LIMIT 3 // Consecutive timeouts before re-probing
+#define SENSOR_IDLE_POLL_MS 50 // Gap between captures with no finger
+#define SENSOR_REPROBE_BACKOFF_MS 30000 // After a sweep that finds nothing
+
+Preferences sensorPrefs;
+uint32_t sensorBaud = 0;
+uint8_t sensorLinkErrors = 0;
+uint32_t sensorResyncs = 0;
+uint32_t sensorProbeBaud = 0; // Rate being tried by a re-probe, 0 = none
+unsigned long nextSensorReprobeAt = 0;
+
+// One outstanding command and its reply
+struct SensorExchange
 {
-  uint8_t p = finger.getImage();
-  if (p != FINGERPRINT_OK)
-    return -1;
+  uint8_t command;
+  bool active;
+  unsigned long sentAt; // micros
+  SensorPacketParser parser;
+  uint8_t reply[16];
+};
 
-  p = finger.image2Tz();
-  if (p != FINGERPRINT_OK)
-    return -1;
+SensorExchange sensorExchange = {};
 
-  p = finger.fingerFastSearch();
-  if (p != FINGERPRINT_OK)
+struct SensorCommandTiming
+{
+  uint8_t command;
+  const char *name;
+  uint32_t count;
+  uint32_t totalUs;
+  uint32_t maxUs;
+};
+
+SensorCommandTiming sensorTimings[] = {
+    {SENSOR_CMD_GETIMAGE, "GetImage", 0, 0, 0},
+    {SENSOR_CMD_IMAGE2TZ, "Image2Tz", 0, 0, 0},
+    {SENSOR_CMD_HISPEEDSEARCH, "Search", 0, 0, 0},
+};
+
+// Identification latency: finger captured to search result
+uint32_t scanCount = 0;
+uint32_t scanTotalUs = 0;
+uint32_t scanMaxUs = 0;
+
+enum ScanStage
+{
+  SCAN_IDLE,
+  SCAN_CAPTURE,
+  SCAN_CONVERT,
+  SCAN_SEARCH,
+  SCAN_PROBE
+};
+
+ScanStage scanStage = SCAN_IDLE;
+unsigned long scanStartedAt = 0; // micros, when the matching capture was sent
+unsigned long nextCaptureAt = 0; // millis
+
+bool probeSensorBaud(uint32_t baud)
+{
+  FINGERPRINT_SERIAL.updateBaudRate(baud);
+  delay(10);
+  drainSensorSerial();
+  return finger.verifyPassword();
+}
+
+// Find the rate the module is listening on, trying the preferred one first.
+// Returns 0 if the module does not answer at any rate.
+uint32_t findSensorBaud(uint32_t preferred)
+{
+  if (preferred && probeSensorBaud(preferred))
   {
-    // LED failure indication
-    indicateFailure();
-    return -1;
+    return preferred;
   }
-
-  Serial.println("Found ID #" + String(finger.fingerID) + " with confidence of " + String(finger.confidence));
-  return finger.fingerID;
+  for (uint32_t baud = SENSOR_TARGET_BAUD; baud >= SENSOR_BAUD_STEP; baud -= SENSOR_BAUD_STEP)
+  {
+    if (baud != preferred && probeSensorBaud(baud))
+    {
+      return baud;
+    }
+  }
+  return 0;
 }
 
-// Function to add attendance
-
-void addAttendance(int fingerprintID)
+// Ask the module to switch to the target rate. The acknowledgement comes
+// at the old rate; if the module is not heard at the new one afterwards,
+// it is probed for again.
+uint32_t raiseSensorBaud(uint32_t baud)
 {
-  String studentId;
-
-  if (fingerprintID)
+  if (finger.setBaudRate(FINGERPRINT_BAUDRATE_115200) != FINGERPRINT_OK)
   {
-
-    Serial.println("Welcome " + String(fingerprintID));
-    studentId = String(fingerprintID);
+    LOG_WARN("Sensor refused baud change, staying at %lu", (unsigned long)baud);
+    return baud;
   }
-  else
+  delay(50);
+  if (probeSensorBaud(SENSOR_TARGET_BAUD))
   {
-    Serial.println("Unknown fingerprint ID");
-    return;
+    return SENSOR_TARGET_BAUD;
   }
+  LOG_WARN("Sensor not answering at %lu after baud change", (unsigned long)SENSOR_TARGET_BAUD);
+  return findSensorBaud(baud);
+}
 
-  // Save attendance to local file (passing only studentId)
-  saveAttendanceToFile(studentId);
-
-  // LED success indication
-  indicateSuccess();
+void saveSensorBaud(uint32_t baud)
+{
+  sensorPrefs.begin("sensor", false);
+  sensorPrefs.putUInt("baud", baud);
+  sensorPrefs.end();
 }
 
-void viewStoredRecords()
+// Bring up the sensor UART at the fastest rate the module supports
+bool connectSensor()
 {
-  File file = SPIFFS.open(attendanceFilePath, FILE_READ);
-  if (!file)
+  sensorPrefs.begin("sensor", true);
+  uint32_t saved = sensorPrefs.getUInt("baud", SENSOR_DEFAULT_BAUD);
+  sensorPrefs.end();
+
+  finger.begin(saved);
+  uint32_t baud = findSensorBaud(saved);
+  if (baud == 0)
   {
-    Serial.println("Failed to open attendance file");
-    return;
+    return false;
+  }
+  if (baud < SENSOR_TARGET_BAUD)
+  {
+    baud = raiseSensorBaud(baud);
+  }
+  if (baud == 0)
+  {
+    return false;
+  }
+  if (baud != saved)
+  {
+    saveSensorBaud(baud);
   }
 
-  Serial.println("\n--- Stored Attendance Records ---");
+  sensorBaud = baud;
+  sensorLinkErrors = 0;
+  LOG_INFO("Sensor link at %lu baud", (unsigned long)sensorBaud);
+  return true;
+}
 
-  // Read and print all lines
-  while (file.available())
+void recordSensorTiming(uint8_t command, uint32_t elapsedUs)
+{
+  for (size_t i = 0; i < sizeof(sensorTimings) / sizeof(sensorTimings[0]); i++)
   {
-    String line = file.readStringUntil('\n');
-    Serial.println(line);
+    SensorCommandTiming &timing = sensorTimings[i];
+    if (timing.command == command)
+    {
+      timing.count++;
+      timing.totalUs += elapsedUs;
+      timing.maxUs = max(timing.maxUs, elapsedUs);
+      return;
+    }
   }
-
-  file.close();
-  Serial.println("--- End of Records ---\n");
 }
 
-// Function to clear attendance data
-void clearAttendanceData()
+// Send a command without waiting for its reply
+void submitSensorCommand(const uint8_t *cmd, uint16_t length)
 {
-  Serial.println("Are you sure you want to clear all attendance records? (Y/N)");
-  Serial.println("WARNING: This will delete all attendance data!");
+  drainSensorSerial();
+  sensorExchange.command = cmd[0];
+  sensorExchange.active = true;
+  beginSensorPacket(sensorExchange.parser, sensorExchange.reply, sizeof(sensorExchange.reply));
+  sensorExchange.sentAt = micros();
+  sendSensorPacket(FINGERPRINT_COMMANDPACKET, cmd, length);
+}
 
-  String confirmation = readInput();
-  if (confirmation == "Y" || confirmation == "y")
+// Collect whatever reply bytes have arrived. Returns SENSOR_PACKET_PENDING
+// until the reply is complete, then its confirmation code.
+int pollSensorReply()
+{
+  if (!sensorExchange.active)
   {
-    // Double confirmation for safety
-    Serial.println("ALL ATTENDANCE RECORDS WILL BE PERMANENTLY DELETED!");
-    Serial.println("Type 'CONFIRM' to proceed:");
+    return FINGERPRINT_PACKETRESPONSEFAIL;
+  }
 
-    String finalConfirmation = readInput();
-    if (finalConfirmation == "CONFIRM")
+  while (FINGERPRINT_SERIAL.available())
+  {
+    int type = feedSensorPacket(sensorExchange.parser, FINGERPRINT_SERIAL.read());
+    if (type == SENSOR_PACKET_PENDING)
     {
-      // Delete the old file
-      if (SPIFFS.remove(attendanceFilePath))
-      {
-        // Create a new file with only the header
-        File file = SPIFFS.open(attendanceFilePath, FILE_WRITE);
-        if (file)
-        {
-          // Write CSV headers
-          file.println("date,student_id,student_name,status,synced");
-          file.close();
-
-          Serial.println("All attendance records have been cleared successfully!");
-          indicateSuccess(); // Visual confirmation
-        }
-        else
-        {
-          Serial.println("Error: Failed to create a new attendance file");
-          indicateFailure();
-        }
-      }
-      else
-      {
-        Serial.println("Error: Failed to remove the old attendance file");
-        indicateFailure();
-      }
+      continue;
     }
-    else
+
+    sensorExchange.active = false;
+    if (type != FINGERPRINT_ACKPACKET || sensorExchange.parser.payloadLength == 0)
     {
-      Serial.println("Operation canceled: Confirmation text didn't match");
+      return FINGERPRINT_BADPACKET;
     }
+    recordSensorTiming(sensorExchange.command, micros() - sensorExchange.sentAt);
+    return sensorExchange.reply[0];
   }
-  else
+
+  if (micros() - sensorExchange.sentAt >= SENSOR_REPLY_TIMEOUT_MS * 1000UL)
   {
-    Serial.println("Operation canceled");
+    sensorExchange.active = false;
+    return FINGERPRINT_TIMEOUT;
   }
+  return SENSOR_PACKET_PENDING;
+}
 
-  delay(2000);
+// Rate to try after baud in a re-probe sweep: the last known rate first,
+// then the others from the top. Returns 0 when the sweep is done.
+uint32_t nextProbeBaud(uint32_t baud)
+{
+  uint32_t next = baud == sensorBaud ? SENSOR_TARGET_BAUD : baud - SENSOR_BAUD_STEP;
+  if (next == sensorBaud)
+  {
+    next -= SENSOR_BAUD_STEP;
+  }
+  return next >= SENSOR_BAUD_STEP ? next : 0;
 }
 
-void enrollMode()
+// Ask the module for its password at one rate; the reply is collected by
+// serviceFingerprintScan like any other command
+void submitSensorProbe(uint32_t baud)
 {
-  Serial.println("Entering Enroll Mode...");
-  Serial.println("Follow instructions on serial monitor");
+  sensorProbeBaud = baud;
+  FINGERPRINT_SERIAL.updateBaudRate(baud);
+  uint8_t cmd[5] = {SENSOR_CMD_VERIFYPASSWORD, 0x00, 0x00, 0x00, 0x00}; // Default password
+  submitSensorCommand(cmd, sizeof(cmd));
+  scanStage = SCAN_PROBE;
+}
 
-  while (true)
+// Called after repeated reply timeouts: the module may have come back at a
+// different rate, so start a sweep to find it again
+void recoverSensorLink()
+{
+  sensorLinkErrors = 0;
+  if (sensorProbeBaud != 0 || (long)(millis() - nextSensorReprobeAt) < 0)
   {
-    enrollFingerprint();
-
-    Serial.println("\nEnrollment options:");
-    Serial.println("1. Enroll another fingerprint");
-    Serial.println("2. Return to main menu");
+    return;
+  }
+  sensorResyncs++;
+  LOG_WARN("Sensor not responding, re-probing baud rate");
+  submitSensorProbe(sensorBaud);
+}
 
-    String option = readInput();
-    if (option == "2")
+// Handle the reply to one probe: keep the rate, move on to the next one, or
+// give up until the backoff expires
+void finishSensorProbe(bool answered)
+{
+  uint32_t baud = sensorProbeBaud;
+  if (answered)
+  {
+    sensorProbeBaud = 0;
+    if (baud != sensorBaud)
     {
-      break;
+      sensorBaud = baud;
+      saveSensorBaud(baud);
     }
+    LOG_INFO("Sensor link restored at %lu baud", (unsigned long)sensorBaud);
+    return;
+  }
+
+  uint32_t next = nextProbeBaud(baud);
+  if (next != 0)
+  {
+    submitSensorProbe(next);
+    return;
   }
+  sensorProbeBaud = 0;
+  nextSensorReprobeAt = millis() + SENSOR_REPROBE_BACKOFF_MS;
+  FINGERPRINT_SERIAL.updateBaudRate(sensorBaud); // Keep the last known rate for the next attempt
+  LOG_ERROR("Sensor lost at all baud rates, retrying in %d s", SENSOR_REPROBE_BACKOFF_MS / 1000);
 }
 
-void setCurrentDate()
+// True between scans, when no sensor command is outstanding
+bool fingerprintScanIdle()
 {
-  Serial.println("Enter today's date in DD/MM format (e.g., 19/5):");
-  String dateInput = readInput();
-  dateInput.trim();
+  return scanStage == SCAN_IDLE;
+}
 
-  // Basic validation - check if the input matches the expected format
-  if (dateInput.length())
+// Let an outstanding command finish so the next exchange starts clean. An
+// unfinished re-probe is abandoned at the last known rate.
+void cancelFingerprintScan()
+{
+  int code;
+  while ((code = pollSensorReply()) == SENSOR_PACKET_PENDING)
   {
-    currentDate = dateInput;
-    Serial.println("Date set to: " + currentDate);
+    delay(1);
   }
-  else
+  if (scanStage == SCAN_PROBE && code == FINGERPRINT_OK)
+  {
+    finishSensorProbe(true);
+  }
+  else if (sensorProbeBaud != 0)
   {
-    Serial.println("Invalid date format. Using default date: " + currentDate);
+    sensorProbeBaud = 0;
+    FINGERPRINT_SERIAL.updateBaudRate(sensorBaud);
   }
+  scanStage = SCAN_IDLE;
 }
 
-void attendanceMode()
+// Advance the scan by at most one command. Returns the matched ID, or -1
+// while no match is available.
+int serviceFingerprintScan()
 {
-  // First set the date for attendance
-  setCurrentDate();
+  if (scanStage == SCAN_IDLE)
+  {
+    if ((long)(millis() - nextCaptureAt) < 0)
+    {
+      return -1;
+    }
+    uint8_t cmd[1] = {SENSOR_CMD_GETIMAGE};
+    submitSensorCommand(cmd, sizeof(cmd));
+    scanStage = SCAN_CAPTURE;
+    return -1;
+  }
+
+  int code = pollSensorReply();
+  if (code == SENSOR_PACKET_PENDING)
+  {
+    return -1;
+  }
 
-  Serial.println("Entering Attendance Mode for date: " + currentDate);
-  Serial.println("Place Finger... (Press 'X' to exit)");
+  ScanStage stage = scanStage;
+  scanStage = SCAN_IDLE;
+  nextCaptureAt = millis() + SENSOR_IDLE_POLL_MS;
 
-  while (true)
+  if (stage == SCAN_PROBE)
   {
-    // Wait for a fingerprint to be detected
-    int fingerprintID = -1;
-    while (fingerprintID == -1)
+    finishSensorProbe(code == FINGERPRINT_OK);
+    return -1;
+  }
+
+  if (code == FINGERPRINT_TIMEOUT || code == FINGERPRINT_BADPACKET)
+  {
+    LOG_DEBUG("Sensor command 0x%02X failed (0x%02X)", sensorExchange.command, code);
+    if (++sensorLinkErrors >= SENSOR_LINK_ERROR_LIMIT)
     {
-      fingerprintID = getFingerprintID();
-      delay(50); // Add a small delay to avoid spamming the sensor
+      recoverSensorLink();
+    }
+    return -1;
+  }
+  sensorLinkErrors = 0;
 
-      // Check if there's a request to exit from Serial
-      if (Serial.available())
-      {
-        String cmd = readInput();
-        if (cmd == "x" || cmd == "X")
-        {
-          Serial.println("Exiting Attendance Mode...");
-          return;
-        }
-      }
+  if (stage == SCAN_CAPTURE)
+  {
+    if (code != FINGERPRINT_OK)
+    {
+      return -1; // No finger yet
     }
+    scanStartedAt = sensorExchange.sentAt;
+    uint8_t cmd[2] = {SENSOR_CMD_IMAGE2TZ, 0x01};
+    submitSensorCommand(cmd, sizeof(cmd));
+    scanStage = SCAN_CONVERT;
+    return -1;
+  }
 
-    // Fingerprint found, add attendance
-    addAttendance(fingerprintID);
-    delay(2000); // Delay before next scan
-    Serial.println("Place Finger... (Press 'X' to exit)");
+  if (stage == SCAN_CONVERT)
+  {
+    if (code != FINGERPRINT_OK)
+    {
+      return -1;
+    }
+    // Search only the slots enrollment uses rather than the whole library
+    uint8_t cmd[6] = {SENSOR_CMD_HISPEEDSEARCH, 0x01, 0x00, 0x00,
+                      (uint8_t)(TEMPLATE_SLOTS >> 8), (uint8_t)(TEMPLATE_SLOTS & 0xFF)};
+    submitSensorCommand(cmd, sizeof(cmd));
+    scanStage = SCAN_SEARCH;
+    return -1;
   }
-}
 
-void clearAllFingerprints()
-{
-  Serial.println("Are you sure you want to clear all fingerprints? (Y/N)");
+  uint32_t elapsedUs = micros() - scanStartedAt;
+  scanCount++;
+  scanTotalUs += elapsedUs;
+  scanMaxUs = max(scanMaxUs, elapsedUs);
 
-  String confirmation = readInput();
-  if (confirmation == "Y" || confirmation == "y")
+  if (code != FINGERPRINT_OK || sensorExchange.parser.payloadLength < 5)
   {
-    Serial.println("Clearing all fingerprints...");
+    // LED failure indication
+    indicateFailure();
+    return -1;
+  }
 
-    uint8_t p = finger.emptyDatabase();
-    if (p == FINGERPRINT_OK)
-    {
-      Serial.println("All fingerprints cleared successfully!");
-    }
-    else
+  finger.fingerID = (sensorExchange.reply[1] << 8) | sensorExchange.reply[2];
+  finger.confidence = (sensorExchange.reply[3] << 8) | sensorExchange.reply[4];
+  LOG_DEBUG("Found ID #%u with confidence of %u in %lu ms", finger.fingerID, finger.confidence,
+            (unsigned long)(elapsedUs / 1000));
+  return finger.fingerID;
+}
+
+void showSensorStatus()
+{
+  consolePrintf("\n--- Sensor Link ---\n");
+  consolePrintf("Baud rate: %lu\n", (unsigned long)sensorBaud);
+  consolePrintf("Link re-probes: %lu\n", (unsigned long)sensorResyncs);
+  for (size_t i = 0; i < sizeof(sensorTimings) / sizeof(sensorTimings[0]); i++)
+  {
+    const SensorCommandTiming &timing = sensorTimings[i];
+    if (timing.count == 0)
     {
-      Serial.println("Failed to clear fingerprints.");
+      consolePrintf("%-9s no samples\n", timing.name);
+      continue;
     }
+    consolePrintf("%-9s n=%lu avg %.1f ms max %.1f ms\n", timing.name, (unsigned long)timing.count,
+                  timing.totalUs / 1000.0f / timing.count, timing.maxUs / 1000.0f);
   }
-  else
+  if (scanCount > 0)
   {
-    Serial.println("Clear operation canceled.");
+    consolePrintf("Identify  n=%lu avg %.1f ms max %.1f ms\n", (unsigned long)scanCount,
+                  scanTotalUs / 1000.0f / scanCount, scanMaxUs / 1000.0f);
   }
-  delay(2000);
 }
 
 void setupLEDs()
@@ -770,7 +3336,7 @@ void setupLEDs()
   delay(300);
   digitalWrite(23, LOW);
 
-  Serial.println("LEDs initialized");
+  LOG_INFO("LEDs initialized");
 }
 
 void indicateSuccess()
@@ -791,24 +3357,27 @@ void indicateFailure()
 
 void setup()
 {
+  // Template imports stream long lines; make room for them while the sensor is busy
+  Serial.setRxBufferSize(2048);
   Serial.begin(115200);
+  startConsoleTx();
 
-  Serial.println("System initialized");
+  consolePuts("System initialized");
 
   // Initialize SPIFFS
   initSPIFFS();
+  loadSyncState();
 
   // Initialize fingerprint sensor
-  Serial.println("Initializing sensor...");
+  consolePuts("Initializing sensor...");
 
-  finger.begin(57600);
-  if (finger.verifyPassword())
+  if (connectSensor())
   {
-    Serial.println("Found fingerprint sensor!");
+    consolePuts("Found fingerprint sensor!");
   }
   else
   {
-    Serial.println("Did not find fingerprint sensor :(");
+    consolePuts("Did not find fingerprint sensor :(");
     while (1)
     {
       delay(1000);
@@ -818,15 +3387,15 @@ void setup()
   setupLEDs();
 
   finger.getTemplateCount();
-  Serial.println("Stored Prints: " + String(finger.templateCount));
+  consolePrintf("Stored Prints: %u\n", finger.templateCount);
 
   if (finger.templateCount == 0)
   {
-    Serial.println("Sensor doesn't contain any fingerprint data. Please enroll a fingerprint.");
+    consolePuts("Sensor doesn't contain any fingerprint data. Please enroll a fingerprint.");
   }
   else
   {
-    Serial.println("Sensor contains " + String(finger.templateCount) + " templates");
+    consolePrintf("Sensor contains %u templates\n", finger.templateCount);
   }
   delay(2000);
 
@@ -834,17 +3403,52 @@ void setup()
   showMainMenu();
 }
 
+// Menu option 5: sync everything now, outside the scheduler. One batch only
+// holds what fits in the arena, so keep sending until the backlog is empty.
+void manualSync()
+{
+  consolePuts("Syncing data to Google Sheets...");
+  int total = 0;
+  int synced;
+  do
+  {
+    synced = syncToGoogle();
+    if (synced < 0 || lastSyncRequestSent)
+    {
+      recordSyncOutcome(synced >= 0, lastSyncRttMs, max(synced, 0));
+    }
+    total += max(synced, 0);
+  } while (synced > 0 && unsyncedCount > 0);
+
+  if (unsyncedCount > 0)
+  {
+    consolePrintf("%d records synced, %d still waiting for the next sync\n", total, unsyncedCount);
+  }
+  else
+  {
+    consolePrintf("%d records synced, nothing left to upload\n", total);
+  }
+}
+
+const MenuCommand mainMenu[] = {
+    {"Enroll Mode", enrollMode},
+    {"Attendance Mode", attendanceMode},
+    {"Clear All Fingerprints", clearAllFingerprints},
+    {"View Stored Records", viewStoredRecords},
+    {"Sync to Google Sheets", manualSync},
+    {"Clear Attendance Data", clearAttendanceData},
+    {"Set Current Date", setCurrentDate},
+    {"Template Backup / Restore", templateTransferMode},
+    {"Sync Status", showSyncStatus},
+    {"Heap Diagnostics", showHeapStatus},
+    {"Attendance Analytics", analyticsMode},
+    {"Sensor Diagnostics", showSensorStatus},
+};
+
 void showMainMenu()
 {
-  Serial.println("\n=== Attendance System Menu ===");
-  Serial.println("1. Enroll Mode");
-  Serial.println("2. Attendance Mode");
-  Serial.println("3. Clear All Fingerprints");
-  Serial.println("4. View Stored Records");
-  Serial.println("5. Sync to Google Sheets");
-  Serial.println("6. Clear Attendance Data");
-  Serial.println("7. Set Current Date");
-  Serial.println("==============================");
+  printMenu("=== Attendance System Menu ===", mainMenu, MENU_SIZE(mainMenu));
+  consolePuts("==============================");
 }
 
 void loop()
@@ -852,47 +3456,19 @@ void loop()
   // Check for input from Serial only
   if (Serial.available())
   {
-    String mode = readInput();
-
-    if (mode == "1")
-    {
-      enrollMode();
-      showMainMenu();
-    }
-    else if (mode == "2")
-    {
-      attendanceMode();
-      showMainMenu();
-    }
-    else if (mode == "3")
-    {
-      clearAllFingerprints();
-      showMainMenu();
-    }
-    else if (mode == "4")
-    {
-      viewStoredRecords();
-      showMainMenu();
-    }
-    else if (mode == "5")
-    {
-      Serial.println("Syncing data to Google Sheets...");
-      syncToGoogle();
-      showMainMenu();
-    }
-    else if (mode == "6")
-    {
-      clearAttendanceData();
-      showMainMenu();
-    }
-    else if (mode == "7")
+    const char *mode = readInput();
+    if (dispatchMenu(mainMenu, MENU_SIZE(mainMenu), mode))
     {
-      setCurrentDate();
       showMainMenu();
     }
     else
     {
-      Serial.println("Invalid choice. Please enter 1-7.");
+      consolePrintf("Invalid choice. Please enter 1-%u.\n", (unsigned)MENU_SIZE(mainMenu));
     }
   }
+  else
+  {
+    // Nothing typed: let the scheduler decide whether a sync is due
+    serviceSyncScheduler(false, false);
+  }
 }
@@ -0,0 +1,454 @@
+#include <sync_journal.h>
+#include <unity.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Files in memory, with a power cut after a chosen number of writes. The
+// write that hits the cut lands only its first half; nothing after it is
+// stored until power is restored.
+class MemoryStorage : public SyncStorage
+{
+public:
+  std::map<std::string, std::vector<uint8_t>> files;
+
+  void cutPowerAfter(int writes)
+  {
+    writesLeft = writes;
+    cut = false;
+  }
+
+  void restorePower()
+  {
+    writesLeft = -1;
+  }
+
+  // Refuse to open files for writing, as a failing flash would
+  bool readOnly = false;
+
+  bool powerWasCut() const { return cut; }
+
+  bool exists(const char *path) { return files.count(path) != 0; }
+
+  bool open(const char *path, const char *mode)
+  {
+    std::string name(path);
+    if (readOnly && (mode[0] == 'w' || mode[1] == '+'))
+    {
+      return false;
+    }
+    if (mode[0] == 'w')
+    {
+      if (!useWrite())
+      {
+        return false;
+      }
+      files[name].clear();
+    }
+    else if (!exists(path))
+    {
+      return false;
+    }
+    current = &files[name];
+    offset = 0;
+    return true;
+  }
+
+  void close() { current = NULL; }
+
+  bool seek(uint32_t position)
+  {
+    if (current == NULL || position > current->size())
+    {
+      return false;
+    }
+    offset = position;
+    return true;
+  }
+
+  uint32_t position() { return offset; }
+  uint32_t size() { return current ? current->size() : 0; }
+
+  size_t read(uint8_t *buffer, size_t length)
+  {
+    size_t n = 0;
+    while (current && n < length && offset < current->size())
+    {
+      buffer[n++] = (*current)[offset++];
+    }
+    return n;
+  }
+
+  size_t write(const uint8_t *buffer, size_t length)
+  {
+    if (current == NULL)
+    {
+      return 0;
+    }
+    bool torn = writesLeft == 0 && !cut;
+    if (!useWrite() && !torn)
+    {
+      return 0;
+    }
+    size_t n = torn ? length / 2 : length;
+    for (size_t i = 0; i < n; i++, offset++)
+    {
+      if (offset < current->size())
+      {
+        (*current)[offset] = buffer[i];
+      }
+      else
+      {
+        current->push_back(buffer[i]);
+      }
+    }
+    return n;
+  }
+
+private:
+  std::vector<uint8_t> *current = NULL;
+  uint32_t offset = 0;
+  int writesLeft = -1; // -1 while powered indefinitely
+  bool cut = false;
+
+  // Spend one write from the budget. False once the power is off.
+  bool useWrite()
+  {
+    if (writesLeft < 0)
+    {
+      return true;
+    }
+    if (writesLeft == 0)
+    {
+      cut = true;
+      return false;
+    }
+    writesLeft--;
+    return true;
+  }
+};
+
+const char *journalPath = "/sync.journal";
+const char *logPath = "/attendance.csv";
+
+// Synced flags of the records in the test log, in order
+const char initialFlags[] = {'0', '1', '0', '0', '0', '0', '1', '0'};
+const int recordCount = sizeof(initialFlags);
+
+// The batch covers records 1-6; records 0 and 7 stay outside it
+const int batchFirst = 1;
+const int batchLast = 6;
+
+struct TestLog
+{
+  uint32_t flagOffsets[recordCount];
+  uint32_t batchStart;
+  uint32_t batchEnd;
+  uint32_t size;
+};
+
+TestLog writeTestLog(MemoryStorage &storage)
+{
+  TestLog log;
+  std::string text = "date,student_id,status,synced\n";
+  for (int i = 0; i < recordCount; i++)
+  {
+    if (i == batchFirst)
+    {
+      log.batchStart = text.size();
+    }
+    text += "19/5," + std::to_string(i + 1) + ",present,";
+    log.flagOffsets[i] = text.size();
+    text += initialFlags[i];
+    text += "\n";
+    if (i == batchLast)
+    {
+      log.batchEnd = text.size();
+    }
+  }
+  storage.files[logPath].assign(text.begin(), text.end());
+  log.size = text.size();
+  return log;
+}
+
+char flagAt(MemoryStorage &storage, const TestLog &log, int record)
+{
+  return storage.files[logPath][log.flagOffsets[record]];
+}
+
+int countNotSynced(MemoryStorage &storage, const TestLog &log)
+{
+  int count = 0;
+  for (int i = 0; i < recordCount; i++)
+  {
+    count += flagAt(storage, log, i) != LOG_FLAG_SYNCED;
+  }
+  return count;
+}
+
+int unsyncedOutsideBatch()
+{
+  int count = 0;
+  for (int i = 0; i < recordCount; i++)
+  {
+    if ((i < batchFirst || i > batchLast) && initialFlags[i] != LOG_FLAG_SYNCED)
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Append one unsynced record after the test log
+void appendTailRecord(MemoryStorage &storage)
+{
+  const char appended[] = "20/5,9,present,0\n";
+  std::vector<uint8_t> &file = storage.files[logPath];
+  file.insert(file.end(), appended, appended + sizeof(appended) - 1);
+}
+
+// After recovery the batch is either fully applied or untouched, nothing
+// outside it has changed, and the count matches the flags on disk plus
+// any unsynced tail records
+void assertConsistent(MemoryStorage &storage, const TestLog &log, const SyncRecovery &recovery,
+                      int tailUnsynced = 0)
+{
+  bool applied = flagAt(storage, log, batchFirst + 1) == LOG_FLAG_SYNCED;
+  for (int i = 0; i < recordCount; i++)
+  {
+    char flag = flagAt(storage, log, i);
+    if (i >= batchFirst && i <= batchLast && applied)
+    {
+      TEST_ASSERT_EQUAL_CHAR(LOG_FLAG_SYNCED, flag);
+    }
+    else
+    {
+      TEST_ASSERT_EQUAL_CHAR(initialFlags[i], flag);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(countNotSynced(storage, log) + tailUnsynced, recovery.unsyncedCount);
+}
+
+void test_commit_applies_whole_batch()
+{
+  MemoryStorage storage;
+  TestLog log = writeTestLog(storage);
+  SyncJournal journal = {&storage, journalPath, logPath, 0};
+  TEST_ASSERT_EQUAL_INT(6, recoverSyncJournal(journal).unsyncedCount);
+
+  int flipped = commitSyncBatch(journal, log.batchStart, log.batchEnd, log.size, unsyncedOutsideBatch());
+  TEST_ASSERT_EQUAL_INT(4, flipped);
+
+  SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+  SyncRecovery recovery = recoverSyncJournal(rebooted);
+  TEST_ASSERT_FALSE(recovery.rescanned);
+  TEST_ASSERT_EQUAL_INT(-1, recovery.finishedRecords);
+  TEST_ASSERT_EQUAL_INT(2, recovery.unsyncedCount);
+  assertConsistent(storage, log, recovery);
+}
+
+void test_commit_survives_power_cut_after_every_write()
+{
+  int cuts = 0;
+  for (int writes = 0;; writes++)
+  {
+    MemoryStorage storage;
+    TestLog log = writeTestLog(storage);
+    SyncJournal journal = {&storage, journalPath, logPath, 0};
+    recoverSyncJournal(journal);
+
+    storage.cutPowerAfter(writes);
+    commitSyncBatch(journal, log.batchStart, log.batchEnd, log.size, unsyncedOutsideBatch());
+    if (!storage.powerWasCut())
+    {
+      break; // The commit finished within the budget
+    }
+    cuts++;
+    storage.restorePower();
+
+    SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+    SyncRecovery recovery = recoverSyncJournal(rebooted);
+    assertConsistent(storage, log, recovery);
+
+    // A second boot finds nothing left to finish and agrees on the count
+    SyncJournal again = {&storage, journalPath, logPath, 0};
+    SyncRecovery second = recoverSyncJournal(again);
+    TEST_ASSERT_EQUAL_INT(-1, second.finishedRecords);
+    TEST_ASSERT_EQUAL_INT(recovery.unsyncedCount, second.unsyncedCount);
+    assertConsistent(storage, log, second);
+  }
+  // Journal commit, four flag flips, journal done
+  TEST_ASSERT_EQUAL_INT(6, cuts);
+}
+
+void test_recovery_keeps_batch_it_cannot_finish()
+{
+  MemoryStorage storage;
+  TestLog log = writeTestLog(storage);
+  SyncJournal journal = {&storage, journalPath, logPath, 0};
+  recoverSyncJournal(journal);
+
+  // Cut after the commit entry and the first flag
+  storage.cutPowerAfter(2);
+  commitSyncBatch(journal, log.batchStart, log.batchEnd, log.size, unsyncedOutsideBatch());
+  storage.restorePower();
+
+  storage.readOnly = true;
+  SyncJournal stuck = {&storage, journalPath, logPath, 0};
+  SyncRecovery pending = recoverSyncJournal(stuck);
+  TEST_ASSERT_TRUE(pending.batchPending);
+  TEST_ASSERT_EQUAL_INT(countNotSynced(storage, log), pending.unsyncedCount);
+
+  SyncJournalEntry entry;
+  TEST_ASSERT_TRUE(readSyncJournal(stuck, &entry));
+  TEST_ASSERT_EQUAL_UINT32(SYNC_BATCH_COMMITTED, entry.state);
+
+  storage.readOnly = false;
+  SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+  SyncRecovery recovery = recoverSyncJournal(rebooted);
+  TEST_ASSERT_FALSE(recovery.batchPending);
+  TEST_ASSERT_EQUAL_INT(3, recovery.finishedRecords);
+  TEST_ASSERT_EQUAL_INT(2, recovery.unsyncedCount);
+  assertConsistent(storage, log, recovery);
+}
+
+void test_recovery_checkpoints_the_tail()
+{
+  MemoryStorage storage;
+  TestLog log = writeTestLog(storage);
+  SyncJournal journal = {&storage, journalPath, logPath, 0};
+  recoverSyncJournal(journal);
+
+  appendTailRecord(storage);
+  uint32_t grownSize = storage.files[logPath].size();
+
+  // The first boot counts the tail from the old checkpoint...
+  SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+  SyncRecovery recovery = recoverSyncJournal(rebooted);
+  TEST_ASSERT_FALSE(recovery.rescanned);
+  TEST_ASSERT_EQUAL_UINT32(log.size, recovery.journalLogSize);
+  TEST_ASSERT_EQUAL_INT(7, recovery.unsyncedCount);
+
+  // ...and moves the checkpoint past it, so the next boot has no tail
+  SyncJournal again = {&storage, journalPath, logPath, 0};
+  SyncRecovery second = recoverSyncJournal(again);
+  TEST_ASSERT_FALSE(second.rescanned);
+  TEST_ASSERT_EQUAL_UINT32(grownSize, second.journalLogSize);
+  TEST_ASSERT_EQUAL_INT(7, second.unsyncedCount);
+}
+
+// States a boot can find the log and journal in. Each ends with one
+// unsynced record appended after the journal's checkpoint.
+TestLog interruptedCommit(MemoryStorage &storage)
+{
+  TestLog log = writeTestLog(storage);
+  SyncJournal journal = {&storage, journalPath, logPath, 0};
+  recoverSyncJournal(journal);
+  storage.cutPowerAfter(2); // Commit entry and the first flag
+  commitSyncBatch(journal, log.batchStart, log.batchEnd, log.size, unsyncedOutsideBatch());
+  storage.restorePower();
+  appendTailRecord(storage);
+  return log;
+}
+
+TestLog checkpointWithTail(MemoryStorage &storage)
+{
+  TestLog log = writeTestLog(storage);
+  SyncJournal journal = {&storage, journalPath, logPath, 0};
+  recoverSyncJournal(journal);
+  appendTailRecord(storage);
+  return log;
+}
+
+TestLog noJournal(MemoryStorage &storage)
+{
+  TestLog log = writeTestLog(storage);
+  appendTailRecord(storage);
+  return log;
+}
+
+void assertRecoverySurvivesPowerCuts(TestLog (*scenario)(MemoryStorage &))
+{
+  int cuts = 0;
+  for (int writes = 0;; writes++)
+  {
+    MemoryStorage storage;
+    TestLog log = scenario(storage);
+
+    storage.cutPowerAfter(writes);
+    SyncJournal cutShort = {&storage, journalPath, logPath, 0};
+    recoverSyncJournal(cutShort);
+    if (!storage.powerWasCut())
+    {
+      break; // Recovery finished within the budget
+    }
+    cuts++;
+    storage.restorePower();
+
+    SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+    SyncRecovery recovery = recoverSyncJournal(rebooted);
+    assertConsistent(storage, log, recovery, 1);
+
+    SyncJournal again = {&storage, journalPath, logPath, 0};
+    SyncRecovery second = recoverSyncJournal(again);
+    TEST_ASSERT_FALSE(second.rescanned);
+    TEST_ASSERT_EQUAL_INT(-1, second.finishedRecords);
+    assertConsistent(storage, log, second, 1);
+  }
+  TEST_ASSERT_TRUE(cuts > 0);
+}
+
+void test_recovery_survives_power_cut_after_every_write()
+{
+  assertRecoverySurvivesPowerCuts(interruptedCommit);
+  assertRecoverySurvivesPowerCuts(checkpointWithTail);
+  assertRecoverySurvivesPowerCuts(noJournal);
+}
+
+// Clearing the log replaces it with a bare header and checkpoints that
+void test_clear_survives_power_cut_after_every_write()
+{
+  const char header[] = "date,student_id,status,synced\n";
+  int cuts = 0;
+  for (int writes = 0;; writes++)
+  {
+    MemoryStorage storage;
+    writeTestLog(storage);
+    SyncJournal journal = {&storage, journalPath, logPath, 0};
+    recoverSyncJournal(journal);
+
+    storage.files[logPath].assign(header, header + sizeof(header) - 1);
+    storage.cutPowerAfter(writes);
+    writeSyncJournal(journal, SYNC_BATCH_DONE, 0, 0, sizeof(header) - 1, 0);
+    if (!storage.powerWasCut())
+    {
+      break;
+    }
+    cuts++;
+    storage.restorePower();
+
+    SyncJournal rebooted = {&storage, journalPath, logPath, 0};
+    TEST_ASSERT_EQUAL_INT(0, recoverSyncJournal(rebooted).unsyncedCount);
+    SyncJournal again = {&storage, journalPath, logPath, 0};
+    SyncRecovery second = recoverSyncJournal(again);
+    TEST_ASSERT_FALSE(second.rescanned);
+    TEST_ASSERT_EQUAL_INT(0, second.unsyncedCount);
+  }
+  TEST_ASSERT_EQUAL_INT(1, cuts);
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_commit_applies_whole_batch);
+  RUN_TEST(test_commit_survives_power_cut_after_every_write);
+  RUN_TEST(test_recovery_keeps_batch_it_cannot_finish);
+  RUN_TEST(test_recovery_checkpoints_the_tail);
+  RUN_TEST(test_recovery_survives_power_cut_after_every_write);
+  RUN_TEST(test_clear_survives_power_cut_after_every_write);
+  return UNITY_END();
+}
@@ -0,0 +1,242 @@
+// Benchmark for the sheet backend in appscript.js, run against the
+// in-memory emulator. Each batch is posted through doPost exactly as the
+// ESP32 sends it, against pre-filled shard sheets and summary.
+//
+// Usage: node tools/appscript/bench.js [--students 1000] [--dates 180]
+//          [--batches 10,50,100,500,1000] [--latency getValue=10,setValue=25]
+//          [--verbose]
+//
+// First checks that records are routed to the right shard sheets and
+// rolled up into the summary, then reports service calls per batch, the
+// busiest call types, the sheets touched and the wall time projected from
+// the per-call latency table.
+
+const { createEnvironment, DEFAULT_LATENCY_MS } = require("./emulator");
+
+const APPS_SCRIPT_LIMIT_MS = 6 * 60 * 1000;
+
+function parseArgs(argv) {
+  const options = {
+    students: 1000,
+    dates: 180,
+    batches: [10, 50, 100, 500, 1000],
+    latency: {},
+    verbose: false,
+  };
+  for (let i = 2; i < argv.length; i++) {
+    const arg = argv[i];
+    if (arg === "--verbose") {
+      options.verbose = true;
+    } else if (arg === "--students") {
+      options.students = Number(argv[++i]);
+    } else if (arg === "--dates") {
+      options.dates = Number(argv[++i]);
+    } else if (arg === "--batches") {
+      options.batches = argv[++i].split(",").map(Number);
+    } else if (arg === "--latency") {
+      for (const pair of argv[++i].split(",")) {
+        const [name, value] = pair.split("=");
+        if (!(name in DEFAULT_LATENCY_MS)) {
+          throw new Error("Unknown latency category: " + name);
+        }
+        options.latency[name] = Number(value);
+      }
+    } else {
+      throw new Error("Unknown option: " + arg);
+    }
+  }
+  return options;
+}
+
+// Session dates in the device's D/M format, one per school day from January
+function sessionDates(count) {
+  const dates = [];
+  const day = new Date(Date.UTC(2025, 0, 1));
+  while (dates.length < count) {
+    const weekday = day.getUTCDay();
+    if (weekday !== 0 && weekday !== 6) {
+      dates.push(`${day.getUTCDate()}/${day.getUTCMonth() + 1}`);
+    }
+    day.setUTCDate(day.getUTCDate() + 1);
+  }
+  return { dates, next: `${day.getUTCDate()}/${day.getUTCMonth() + 1}` };
+}
+
+// Attendance shard as the backend leaves it: ID, statistics, then one
+// column per date. Deterministic so runs are comparable.
+function buildAttendanceRows(students, dates, seed) {
+  const header = ["Student ID", "Attended Days", "Percentage"].concat(dates);
+  const rows = [header];
+  for (let id = 1; id <= students; id++) {
+    const row = [String(id), 0, ""];
+    let present = 0;
+    for (let d = 0; d < dates.length; d++) {
+      seed = (seed * 1103515245 + 12345) % 2147483648;
+      if (seed % 100 < 85) {
+        row.push("present");
+        present++;
+      } else {
+        row.push("");
+      }
+    }
+    row[1] = present;
+    row[2] = ((present / dates.length) * 100).toFixed(1) + "%";
+    rows.push(row);
+  }
+  return rows;
+}
+
+// Split the session dates into shard sheets using the backend's own routing
+function buildShards(sandbox, students, dates) {
+  const byShard = new Map();
+  for (const date of dates) {
+    const name = sandbox.shardSheetName("Attendance", date);
+    if (!byShard.has(name)) {
+      byShard.set(name, []);
+    }
+    byShard.get(name).push(date);
+  }
+  const shards = [];
+  let seed = 12345;
+  for (const [name, shardDates] of byShard) {
+    shards.push({ name, rows: buildAttendanceRows(students, shardDates, seed++) });
+  }
+  return shards;
+}
+
+// Install the shard fixture and seed the summary from it, uncharged
+function installShards(env, shards) {
+  for (const shard of shards) {
+    env.spreadsheet.addSheet(
+      shard.name,
+      shard.rows.map((row) => row.slice())
+    );
+  }
+  env.sandbox.rebuildAttendanceSummary("Attendance");
+  env.stats.reset();
+}
+
+function post(env, records) {
+  const payload = { command: "batch_attendance", sheet_name: "Attendance", records };
+  const output = env.sandbox.doPost({ postData: { contents: JSON.stringify(payload) } });
+  const result = JSON.parse(output.getContent());
+  if (result.result !== "success") {
+    throw new Error(`Batch of ${records.length} failed: ${result.message}`);
+  }
+  return result;
+}
+
+function expect(condition, message) {
+  if (!condition) {
+    throw new Error("Routing check failed: " + message);
+  }
+}
+
+// Post records spanning several months and check where they land
+function checkRouting() {
+  const env = createEnvironment();
+  const rows = (sheetName) => env.spreadsheet.sheets.get(sheetName).rows;
+  const summaryRow = (id) => rows("Attendance Summary").find((row) => row[0] === id);
+
+  let result = post(env, [
+    { date: "3/2", student_id: "1", status: "present" },
+    { date: "4/2", student_id: "1", status: "present" },
+    { date: "4/2", student_id: "2", status: "present" },
+    { date: "10/3", student_id: "2", status: "present" },
+    { date: "03/12/2025", student_id: "3", status: "present" },
+  ]);
+  expect(
+    result.shards.join(",") === "Attendance Feb,Attendance Mar",
+    "shards " + result.shards.join(",")
+  );
+  expect(rows("Attendance Feb")[0].slice(3).join(",") === "3/2,4/2", "Feb dates");
+  expect(rows("Attendance Mar")[0].slice(3).join(",") === "10/3,03/12/2025", "Mar dates");
+
+  const header = rows("Attendance Summary")[0];
+  expect(header.slice(3).join(",") === "Attendance Feb,Attendance Mar", "summary columns");
+  expect(rows("Attendance Summary")[1][1] === 4, "total sessions");
+  expect(summaryRow("1")[1] === 2 && summaryRow("2")[1] === 2, "student totals");
+  expect(summaryRow("2")[2] === "50.0%", "percentage " + summaryRow("2")[2]);
+
+  // A batch for one month must leave the other shard alone and keep its
+  // totals in the summary
+  env.stats.reset();
+  result = post(env, [{ date: "11/3", student_id: "1", status: "present" }]);
+  expect(result.shards.join(",") === "Attendance Mar", "single shard");
+  expect(!("Attendance Feb" in env.stats.sheets), "Feb shard was touched");
+  expect(rows("Attendance Summary")[1][1] === 5, "total sessions after second batch");
+  expect(summaryRow("1")[1] === 3, "student 1 total after second batch");
+}
+
+function buildBatch(size, students, date) {
+  const records = [];
+  for (let i = 0; i < size; i++) {
+    // Spread across the roster; sizes above the roster size repeat students
+    const id = ((i * 7919) % students) + 1;
+    records.push({ date: date, student_id: String(id), status: "present" });
+  }
+  return records;
+}
+
+function formatCalls(calls) {
+  return Object.entries(calls)
+    .sort((a, b) => b[1] - a[1])
+    .slice(0, 4)
+    .map(([name, count]) => `${name}=${count}`)
+    .join(" ");
+}
+
+function runBatch(options, shards, batchSize, date) {
+  const env = createEnvironment({ latency: options.latency, verbose: options.verbose });
+  installShards(env, shards);
+
+  const start = process.hrtime.bigint();
+  post(env, buildBatch(batchSize, options.students, date));
+  const elapsedMs = Number(process.hrtime.bigint() - start) / 1e6;
+
+  return {
+    batchSize,
+    calls: env.stats.total,
+    breakdown: formatCalls(env.stats.calls),
+    sheets: Object.keys(env.stats.sheets).length,
+    projectedMs: env.stats.projectedMs,
+    elapsedMs,
+  };
+}
+
+function main() {
+  const options = parseArgs(process.argv);
+
+  checkRouting();
+  console.log("Routing check: ok");
+
+  const { dates, next } = sessionDates(options.dates);
+  const { sandbox } = createEnvironment();
+  const shards = buildShards(sandbox, options.students, dates);
+
+  console.log(
+    `Sheet: ${options.students} students x ${options.dates} dates in ${shards.length} shards, ` +
+      `new records dated ${next} go to "${sandbox.shardSheetName("Attendance", next)}"`
+  );
+  console.log(
+    "Latency (ms): " +
+      Object.entries(Object.assign({}, DEFAULT_LATENCY_MS, options.latency))
+        .map(([name, value]) => `${name}=${value}`)
+        .join(" ")
+  );
+  console.log("");
+  console.log("batch      calls   calls/rec   projected   node ms   sheets   top calls");
+
+  for (const batchSize of options.batches) {
+    const run = runBatch(options, shards, batchSize, next);
+    const projected = (run.projectedMs / 1000).toFixed(1) + " s";
+    const flag = run.projectedMs > APPS_SCRIPT_LIMIT_MS ? " (over 6 min limit)" : "";
+    console.log(
+      `${String(run.batchSize).padStart(5)} ${String(run.calls).padStart(10)} ${(run.calls / run.batchSize)
+        .toFixed(1)
+        .padStart(11)} ${projected.padStart(11)} ${run.elapsedMs.toFixed(0).padStart(9)} ${String(run.sheets).padStart(8)}   ${run.breakdown}${flag}`
+    );
+  }
+}
+
+main();
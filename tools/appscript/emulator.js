@@ -0,0 +1,379 @@
+// In-memory stand-in for the Apps Script services used by appscript.js, so
+// the backend can be run and measured under Node without deploying.
+//
+// Every service call is counted, and each call is charged a configurable
+// latency so a run can be projected onto Apps Script wall time. Nothing
+// actually sleeps; the latency is only summed.
+
+const fs = require("fs");
+const path = require("path");
+const vm = require("vm");
+
+// Rough per-call costs in milliseconds. Reads are served from the sheet
+// cache after the first fetch, writes and formatting force a round trip.
+const DEFAULT_LATENCY_MS = {
+  getRange: 1,
+  getValue: 10,
+  getValues: 10,
+  setValue: 25,
+  setValues: 25,
+  getLastRow: 2,
+  getLastColumn: 2,
+  format: 20,
+  insertColumn: 50,
+  insertSheet: 200,
+  sort: 100,
+  other: 1,
+};
+
+class CallStats {
+  constructor(latency) {
+    this.latency = Object.assign({}, DEFAULT_LATENCY_MS, latency || {});
+    this.reset();
+  }
+
+  reset() {
+    this.calls = {};
+    this.sheets = {};
+    this.total = 0;
+    this.projectedMs = 0;
+  }
+
+  // sheetName is given for calls on a sheet or range, to show which sheets
+  // a run touched
+  charge(name, category, sheetName) {
+    this.calls[name] = (this.calls[name] || 0) + 1;
+    if (sheetName !== undefined) {
+      this.sheets[sheetName] = (this.sheets[sheetName] || 0) + 1;
+    }
+    this.total++;
+    const cost = this.latency[category || name];
+    this.projectedMs += cost !== undefined ? cost : this.latency.other;
+  }
+}
+
+// Convert a column letter string ("A", "AB") to a 1-based index
+function columnIndex(letters) {
+  let index = 0;
+  for (const ch of letters.toUpperCase()) {
+    index = index * 26 + (ch.charCodeAt(0) - 64);
+  }
+  return index;
+}
+
+class FakeRange {
+  constructor(sheet, row, column, numRows, numColumns) {
+    this.sheet = sheet;
+    this.row = row;
+    this.column = column;
+    this.numRows = numRows;
+    this.numColumns = numColumns;
+  }
+
+  getValue() {
+    this.sheet.charge("getValue");
+    return this.sheet.cell(this.row, this.column);
+  }
+
+  getValues() {
+    this.sheet.charge("getValues");
+    const values = [];
+    for (let r = 0; r < this.numRows; r++) {
+      const row = [];
+      for (let c = 0; c < this.numColumns; c++) {
+        row.push(this.sheet.cell(this.row + r, this.column + c));
+      }
+      values.push(row);
+    }
+    return values;
+  }
+
+  setValue(value) {
+    this.sheet.charge("setValue");
+    for (let r = 0; r < this.numRows; r++) {
+      for (let c = 0; c < this.numColumns; c++) {
+        this.sheet.setCell(this.row + r, this.column + c, value);
+      }
+    }
+    return this;
+  }
+
+  setValues(values) {
+    this.sheet.charge("setValues");
+    if (values.length !== this.numRows || values[0].length !== this.numColumns) {
+      throw new Error("setValues dimensions do not match the range");
+    }
+    for (let r = 0; r < this.numRows; r++) {
+      for (let c = 0; c < this.numColumns; c++) {
+        this.sheet.setCell(this.row + r, this.column + c, values[r][c]);
+      }
+    }
+    return this;
+  }
+
+  setFontWeight() {
+    this.sheet.charge("setFontWeight", "format");
+    return this;
+  }
+
+  setBackground() {
+    this.sheet.charge("setBackground", "format");
+    return this;
+  }
+
+  setNumberFormat() {
+    this.sheet.charge("setNumberFormat", "format");
+    return this;
+  }
+
+  // Sort rows of the range; spec.column is an absolute sheet column
+  sort(spec) {
+    this.sheet.charge("sort");
+    const index = spec.column - 1;
+    const ascending = spec.ascending !== false;
+    const rows = this.sheet.rows.slice(this.row - 1, this.row - 1 + this.numRows);
+    rows.sort((a, b) => {
+      const x = a[index];
+      const y = b[index];
+      if (x === y) {
+        return 0;
+      }
+      const result = x < y ? -1 : 1;
+      return ascending ? result : -result;
+    });
+    for (let r = 0; r < rows.length; r++) {
+      this.sheet.rows[this.row - 1 + r] = rows[r];
+    }
+    return this;
+  }
+}
+
+class FakeSheet {
+  constructor(name, stats, rows) {
+    this.name = name;
+    this.stats = stats;
+    this.rows = rows || [];
+    this.frozenRows = 0;
+  }
+
+  getName() {
+    return this.name;
+  }
+
+  charge(name, category) {
+    this.stats.charge(name, category, this.name);
+  }
+
+  cell(row, column) {
+    const r = this.rows[row - 1];
+    if (!r || r[column - 1] === undefined || r[column - 1] === null) {
+      return "";
+    }
+    return r[column - 1];
+  }
+
+  setCell(row, column, value) {
+    while (this.rows.length < row) {
+      this.rows.push([]);
+    }
+    this.rows[row - 1][column - 1] = value;
+  }
+
+  lastRow() {
+    for (let r = this.rows.length; r > 0; r--) {
+      if (this.rows[r - 1].some((v) => v !== "" && v !== undefined && v !== null)) {
+        return r;
+      }
+    }
+    return 0;
+  }
+
+  lastColumn() {
+    let last = 0;
+    for (const row of this.rows) {
+      for (let c = row.length; c > last; c--) {
+        if (row[c - 1] !== "" && row[c - 1] !== undefined && row[c - 1] !== null) {
+          last = c;
+          break;
+        }
+      }
+    }
+    return last;
+  }
+
+  getLastRow() {
+    this.charge("getLastRow");
+    return this.lastRow();
+  }
+
+  getLastColumn() {
+    this.charge("getLastColumn");
+    return this.lastColumn();
+  }
+
+  // Supports getRange(row, column[, numRows, numColumns]) and the A1 forms
+  // used by the script ("A1", "1:1")
+  getRange(a, b, c, d) {
+    this.charge("getRange");
+    if (typeof a === "string") {
+      const rowSpan = /^(\d+):(\d+)$/.exec(a);
+      if (rowSpan) {
+        const first = Number(rowSpan[1]);
+        const rows = Number(rowSpan[2]) - first + 1;
+        return new FakeRange(this, first, 1, rows, Math.max(this.lastColumn(), 1));
+      }
+      const cellRef = /^([A-Za-z]+)(\d+)$/.exec(a);
+      if (cellRef) {
+        return new FakeRange(this, Number(cellRef[2]), columnIndex(cellRef[1]), 1, 1);
+      }
+      throw new Error("Unsupported A1 notation: " + a);
+    }
+    if (a < 1 || b < 1) {
+      throw new Error(`Invalid range start ${a},${b}`);
+    }
+    return new FakeRange(this, a, b, c || 1, d || 1);
+  }
+
+  insertColumnAfter(column) {
+    this.charge("insertColumnAfter", "insertColumn");
+    for (const row of this.rows) {
+      if (row.length > column) {
+        row.splice(column, 0, "");
+      }
+    }
+    return this;
+  }
+
+  setFrozenRows(rows) {
+    this.charge("setFrozenRows", "format");
+    this.frozenRows = rows;
+  }
+
+  getFrozenRows() {
+    this.charge("getFrozenRows");
+    return this.frozenRows;
+  }
+
+  autoResizeColumn() {
+    this.charge("autoResizeColumn", "format");
+    return this;
+  }
+
+  autoResizeColumns() {
+    this.charge("autoResizeColumns", "format");
+    return this;
+  }
+}
+
+class FakeSpreadsheet {
+  constructor(stats) {
+    this.stats = stats;
+    this.sheets = new Map();
+  }
+
+  getSheetByName(name) {
+    this.stats.charge("getSheetByName");
+    return this.sheets.get(name) || null;
+  }
+
+  getSheets() {
+    this.stats.charge("getSheets");
+    return Array.from(this.sheets.values());
+  }
+
+  insertSheet(name) {
+    this.stats.charge("insertSheet");
+    if (this.sheets.has(name)) {
+      throw new Error("A sheet with the name " + name + " already exists");
+    }
+    const sheet = new FakeSheet(name, this.stats);
+    this.sheets.set(name, sheet);
+    return sheet;
+  }
+
+  // Fixture helper, not part of the Apps Script API: install a sheet
+  // without charging for it
+  addSheet(name, rows) {
+    const sheet = new FakeSheet(name, this.stats, rows);
+    this.sheets.set(name, sheet);
+    return sheet;
+  }
+}
+
+class TextOutput {
+  constructor(content) {
+    this.content = content;
+    this.mimeType = "text/plain";
+  }
+
+  setMimeType(mimeType) {
+    this.mimeType = mimeType;
+    return this;
+  }
+
+  getContent() {
+    return this.content;
+  }
+}
+
+function pad(n) {
+  return n < 10 ? "0" + n : String(n);
+}
+
+// Build a sandbox with the Apps Script globals and load a script into it.
+// Returns the sandbox (script functions are properties of it), the fake
+// spreadsheet and the call statistics.
+function createEnvironment(options) {
+  options = options || {};
+  const stats = new CallStats(options.latency);
+  const spreadsheet = new FakeSpreadsheet(stats);
+  const logs = [];
+
+  const sandbox = {
+    console: console,
+    JSON: JSON,
+    Math: Math,
+    Date: Date,
+    SpreadsheetApp: {
+      getActiveSpreadsheet() {
+        stats.charge("getActiveSpreadsheet");
+        return spreadsheet;
+      },
+    },
+    ContentService: {
+      MimeType: { JSON: "application/json", TEXT: "text/plain" },
+      createTextOutput(content) {
+        return new TextOutput(content);
+      },
+    },
+    Logger: {
+      log(message) {
+        logs.push(String(message));
+        if (options.verbose) {
+          console.log("[Logger] " + message);
+        }
+      },
+    },
+    Session: {
+      getScriptTimeZone() {
+        return "UTC";
+      },
+    },
+    Utilities: {
+      formatDate(date, timeZone, format) {
+        return format
+          .replace("yyyy", date.getUTCFullYear())
+          .replace("MM", pad(date.getUTCMonth() + 1))
+          .replace("dd", pad(date.getUTCDate()));
+      },
+    },
+  };
+  vm.createContext(sandbox);
+
+  const scriptPath = options.scriptPath || path.join(__dirname, "..", "..", "appscript.js");
+  vm.runInContext(fs.readFileSync(scriptPath, "utf8"), sandbox, { filename: scriptPath });
+
+  return { sandbox, spreadsheet, stats, logs };
+}
+
+module.exports = { createEnvironment, DEFAULT_LATENCY_MS, FakeSheet };
@@ -0,0 +1,230 @@
+// Minimal MQTT 3.1.1 broker and Google Sheets bridge for the device's
+// streaming uplink. Accepts CONNECT, answers PINGREQ, and for each QoS 1
+// PUBLISH posts the record to the Apps Script deployment (the same
+// batch_attendance command the device's HTTPS path uses). The PUBACK is
+// only sent once the script reports success, and the device treats it as
+// "in the sheet": it marks the record synced. A record whose post fails is
+// not acknowledged and reaches the sheet through the device's HTTPS batch.
+//
+// Usage: node tools/mqtt-standin.js --forward <script URL> [--port 1883]
+//            [--ack-delay ms] [--drop percent]
+//        node tools/mqtt-standin.js --ack-only [...]
+//
+// --ack-delay holds each PUBACK back to simulate a slow bridge, and --drop
+// skips a percentage of PUBACKs to exercise the device's retransmit and
+// HTTPS fallback paths. --ack-only acknowledges without forwarding, for
+// protocol testing only: the device marks those records synced although
+// they never reach the sheet.
+
+const net = require("net");
+
+function parseArgs(argv) {
+  const options = { port: 1883, ackDelay: 0, drop: 0, forward: null, ackOnly: false };
+  for (let i = 2; i < argv.length; i += 2) {
+    const value = Number(argv[i + 1]);
+    if (argv[i] === "--port") {
+      options.port = value;
+    } else if (argv[i] === "--ack-delay") {
+      options.ackDelay = value;
+    } else if (argv[i] === "--drop") {
+      options.drop = value;
+    } else if (argv[i] === "--forward") {
+      options.forward = argv[i + 1];
+    } else if (argv[i] === "--ack-only") {
+      options.ackOnly = true;
+      i--; // No value
+    } else {
+      console.error("Unknown option: " + argv[i]);
+      process.exit(1);
+    }
+  }
+  if (!options.forward && !options.ackOnly) {
+    console.error("Pass --forward <script URL>, or --ack-only for protocol testing");
+    process.exit(1);
+  }
+  return options;
+}
+
+const options = parseArgs(process.argv);
+const stats = { records: 0, duplicates: 0, dropped: 0, forwarded: 0, failed: 0 };
+
+// Records already written to the sheet or on their way there, keyed by
+// client, packet ID and payload, so a retransmit after a lost PUBACK is
+// acknowledged again instead of posted twice
+const DELIVERY_TTL_MS = 10 * 60 * 1000;
+const deliveries = new Map();
+
+function forgetOldDeliveries() {
+  const cutoff = Date.now() - DELIVERY_TTL_MS;
+  for (const [key, delivery] of deliveries) {
+    if (delivery.at < cutoff) {
+      deliveries.delete(key);
+    }
+  }
+}
+
+// Post one record to the Apps Script. Resolves true once the script has
+// stored it. fetch follows the script's redirect to its JSON result.
+async function forwardRecord(payload) {
+  if (options.ackOnly) {
+    return true;
+  }
+  const record = JSON.parse(payload);
+  const response = await fetch(options.forward, {
+    method: "POST",
+    headers: { "Content-Type": "application/json" },
+    body: JSON.stringify({
+      command: "batch_attendance",
+      sheet_name: "Attendance",
+      records: [record],
+    }),
+  });
+  if (!response.ok) {
+    throw new Error("HTTP " + response.status);
+  }
+  const result = JSON.parse(await response.text());
+  if (result.result !== "success") {
+    throw new Error(result.message || "script reported " + result.result);
+  }
+  return true;
+}
+
+// Resolves once the record is in the sheet, posting it at most once
+function deliver(clientId, packetId, payload) {
+  forgetOldDeliveries();
+  const key = `${clientId}:${packetId}:${payload}`;
+  let delivery = deliveries.get(key);
+  if (!delivery) {
+    delivery = { at: Date.now(), done: forwardRecord(payload) };
+    deliveries.set(key, delivery);
+    delivery.done.then(
+      () => stats.forwarded++,
+      (error) => {
+        // Let a retransmit try again
+        deliveries.delete(key);
+        stats.failed++;
+        console.error(`Forward of #${packetId} failed, not acknowledged: ${error.message}`);
+      }
+    );
+  }
+  return delivery.done;
+}
+
+// Decode the variable-length "remaining length" field
+function readRemainingLength(buffer, offset) {
+  let multiplier = 1;
+  let value = 0;
+  for (let i = 0; i < 4; i++) {
+    if (offset + i >= buffer.length) {
+      return null;
+    }
+    const digit = buffer[offset + i];
+    value += (digit & 0x7f) * multiplier;
+    multiplier *= 128;
+    if ((digit & 0x80) === 0) {
+      return { value: value, bytes: i + 1 };
+    }
+  }
+  throw new Error("Malformed remaining length");
+}
+
+function handlePacket(socket, type, flags, body) {
+  if (type === 0x10) {
+    // CONNECT: accept unconditionally
+    const idLength = body.readUInt16BE(10);
+    const clientId = body.slice(12, 12 + idLength).toString();
+    socket.clientId = clientId;
+    console.log(`CONNECT from ${clientId} (${socket.remoteAddress})`);
+    socket.write(Buffer.from([0x20, 0x02, 0x00, 0x00]));
+  } else if (type === 0x30) {
+    // PUBLISH
+    const qos = (flags >> 1) & 0x03;
+    const duplicate = (flags & 0x08) !== 0;
+    const topicLength = body.readUInt16BE(0);
+    const topic = body.slice(2, 2 + topicLength).toString();
+    let offset = 2 + topicLength;
+    let packetId = 0;
+    if (qos > 0) {
+      packetId = body.readUInt16BE(offset);
+      offset += 2;
+    }
+    const payload = body.slice(offset).toString();
+
+    stats.records++;
+    if (duplicate) {
+      stats.duplicates++;
+    }
+    console.log(
+      `${new Date().toISOString()} ${topic} #${packetId}${duplicate ? " (dup)" : ""} ${payload}`
+    );
+
+    if (qos === 1) {
+      deliver(socket.clientId, packetId, payload).then(
+        () => {
+          if (Math.random() * 100 < options.drop) {
+            stats.dropped++;
+            return;
+          }
+          const puback = Buffer.from([0x40, 0x02, packetId >> 8, packetId & 0xff]);
+          if (options.ackDelay > 0) {
+            setTimeout(() => socket.writable && socket.write(puback), options.ackDelay);
+          } else if (socket.writable) {
+            socket.write(puback);
+          }
+        },
+        () => {} // Already reported; the device falls back to HTTPS
+      );
+    }
+  } else if (type === 0xc0) {
+    // PINGREQ
+    socket.write(Buffer.from([0xd0, 0x00]));
+  } else if (type === 0xe0) {
+    // DISCONNECT
+    console.log(
+      `DISCONNECT: ${stats.records} records, ${stats.duplicates} duplicates, ` +
+        `${stats.forwarded} forwarded, ${stats.failed} forwards failed, ${stats.dropped} acks dropped`
+    );
+    socket.end();
+  }
+}
+
+const server = net.createServer((socket) => {
+  socket.setNoDelay(true);
+  let pending = Buffer.alloc(0);
+
+  socket.on("data", (chunk) => {
+    pending = Buffer.concat([pending, chunk]);
+    try {
+      while (pending.length >= 2) {
+        const length = readRemainingLength(pending, 1);
+        if (!length) {
+          return;
+        }
+        const start = 1 + length.bytes;
+        if (pending.length < start + length.value) {
+          return;
+        }
+        handlePacket(
+          socket,
+          pending[0] & 0xf0,
+          pending[0] & 0x0f,
+          pending.slice(start, start + length.value)
+        );
+        pending = pending.slice(start + length.value);
+      }
+    } catch (error) {
+      console.error("Protocol error: " + error.message);
+      socket.destroy();
+    }
+  });
+
+  socket.on("error", (error) => console.error("Socket error: " + error.message));
+});
+
+server.listen(options.port, () => {
+  console.log(
+    `MQTT bridge listening on port ${options.port} ` +
+      `(${options.ackOnly ? "ack only, NOT forwarding to the sheet" : "forwarding to " + options.forward}, ` +
+      `ack delay ${options.ackDelay} ms, drop ${options.drop}%)`
+  );
+});